@@ -0,0 +1 @@
+select pllua_bench.f_array(array(select generate_series(1,100)));
@@ -0,0 +1 @@
+select pllua_bench.f_bytea('\x000102030405060708090a0b0c0d0e0f');
@@ -0,0 +1 @@
+select pllua_bench.f_float(1.5);
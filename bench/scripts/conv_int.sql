@@ -0,0 +1 @@
+select pllua_bench.f_int(1, 2);
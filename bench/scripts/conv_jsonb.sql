@@ -0,0 +1 @@
+select pllua_bench.f_jsonb('{"a": 1, "b": "two", "items": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10]}');
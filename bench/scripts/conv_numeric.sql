@@ -0,0 +1 @@
+select pllua_bench.f_numeric(12345.6789);
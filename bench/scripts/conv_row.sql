@@ -0,0 +1 @@
+select pllua_bench.f_row(row(1, 'name', 1.5, '2020-01-01 00:00+00')::pllua_bench.bench_row);
@@ -0,0 +1 @@
+select pllua_bench.f_text('the quick brown fox jumps over the lazy dog');
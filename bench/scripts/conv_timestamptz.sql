@@ -0,0 +1 @@
+select pllua_bench.f_timestamptz('2020-01-01 12:34:56+00');
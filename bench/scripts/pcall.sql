@@ -0,0 +1 @@
+select pllua_bench.f_pcall(1000);
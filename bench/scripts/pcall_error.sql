@@ -0,0 +1 @@
+select pllua_bench.f_pcall_error(1000);
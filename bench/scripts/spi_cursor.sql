@@ -0,0 +1 @@
+select pllua_bench.f_spi_cursor(100);
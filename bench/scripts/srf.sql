@@ -0,0 +1 @@
+select count(*) from pllua_bench.f_srf(1000);
@@ -0,0 +1 @@
+update pllua_bench.trig_none set n = n + 1 where id = 1;
@@ -0,0 +1,129 @@
+-- setup.sql: objects used by the benchmark scripts
+--
+-- Everything lives in the pllua_bench schema, which is dropped and
+-- recreated on each run.
+
+\set ON_ERROR_STOP 1
+set client_min_messages = warning;
+
+create extension if not exists pllua;
+create extension if not exists plluau;
+
+drop schema if exists pllua_bench cascade;
+create schema pllua_bench;
+set search_path = pllua_bench, public;
+
+-- identifies the Lua the server is using, for the results
+
+create function lua_version() returns text language plluau
+  as $$ return _VERSION .. (jit and (" " .. jit.version) or "") $$;
+
+-- call overhead
+
+create function f_empty() returns void language pllua as $$ $$;
+
+-- argument and result conversion, one function per type class
+
+create function f_int(a integer, b bigint) returns bigint language pllua
+  as $$ return a + b $$;
+create function f_float(a float8) returns float8 language pllua
+  as $$ return a * 2 $$;
+create function f_numeric(a numeric) returns numeric language pllua
+  as $$ return a + 1 $$;
+create function f_text(a text) returns text language pllua
+  as $$ return a $$;
+create function f_bytea(a bytea) returns bytea language pllua
+  as $$ return a $$;
+create function f_timestamptz(a timestamptz) returns timestamptz language pllua
+  as $$ return a $$;
+
+create type bench_row as (id integer, name text, val float8, ts timestamptz);
+create function f_row(a bench_row) returns bench_row language pllua
+  as $$ return { id = a.id + 1, name = a.name, val = a.val, ts = a.ts } $$;
+
+-- arrays and jsonb: convert to and from Lua tables
+
+create function f_array(a integer[]) returns integer[] language pllua
+  as $$
+    local t = a{}
+    for i = 1,#t do t[i] = t[i] + 1 end
+    return t
+  $$;
+create function f_jsonb(a jsonb) returns jsonb language pllua
+  as $$
+    local t = a{}
+    t.n = #t.items
+    return t
+  $$;
+
+-- SPI
+
+create table spi_data (id integer primary key, val text);
+insert into spi_data select i, 'row ' || i from generate_series(1,1000) i;
+analyze spi_data;
+
+create function f_spi_execute(n integer) returns integer language pllua
+  as $$
+    local s = 0
+    for i = 1,n do
+      local r = spi.execute("select id from pllua_bench.spi_data where id = $1", i)
+      s = s + r[1].id
+    end
+    return s
+  $$;
+create function f_spi_prepared(n integer) returns integer language pllua
+  as $$
+    local stmt = spi.prepare("select id from pllua_bench.spi_data where id = $1",
+                             {"integer"})
+    local s = 0
+    for i = 1,n do
+      s = s + stmt:execute(i)[1].id
+    end
+    return s
+  $$;
+create function f_spi_cursor(n integer) returns integer language pllua
+  as $$
+    local s = 0
+    for r in spi.rows("select id from pllua_bench.spi_data where id <= $1", n) do
+      s = s + r.id
+    end
+    return s
+  $$;
+
+-- triggers; trig_none is the baseline for the same update without one
+
+create table trig_none (id integer primary key, n integer);
+create table trig_lua (id integer primary key, n integer);
+insert into trig_none values (1, 0);
+insert into trig_lua values (1, 0);
+
+create function f_trigger() returns trigger language pllua
+  as $$ new.n = new.n + 1 return new $$;
+create trigger trig_lua_t before update on trig_lua
+  for each row execute procedure f_trigger();
+
+-- set-returning functions
+
+create function f_srf(n integer) returns setof integer language pllua
+  as $$ for i = 1,n do coroutine.yield(i) end $$;
+
+-- pcall
+
+create function f_pcall(n integer) returns integer language pllua
+  as $$
+    local ok = 0
+    local function f(i) return i end
+    for i = 1,n do
+      if pcall(f, i) then ok = ok + 1 end
+    end
+    return ok
+  $$;
+
+create function f_pcall_error(n integer) returns integer language pllua
+  as $$
+    local caught = 0
+    for i = 1,n do
+      if not pcall(error, "x") then caught = caught + 1 end
+    end
+    return caught
+  $$;
@@ -0,0 +1,72 @@
+\echo Use "CREATE EXTENSION pllua" to load this file. \quit
+
+CREATE FUNCTION pllua_call_handler()
+  RETURNS language_handler AS 'MODULE_PATHNAME', 'pllua_call_handler'
+  LANGUAGE C;
+
+CREATE FUNCTION pllua_inline_handler(internal)
+  RETURNS VOID AS 'MODULE_PATHNAME', 'pllua_inline_handler'
+  LANGUAGE C STRICT;
+
+CREATE FUNCTION pllua_validator(oid)
+  RETURNS VOID AS 'MODULE_PATHNAME', 'pllua_validator'
+  LANGUAGE C STRICT;
+
+CREATE TRUSTED LANGUAGE pllua
+  HANDLER pllua_call_handler
+  INLINE pllua_inline_handler
+  VALIDATOR pllua_validator;
+
+CREATE FUNCTION pllua_profile_start(sample_interval integer DEFAULT 1000)
+  RETURNS VOID AS 'MODULE_PATHNAME', 'pllua_profile_start'
+  LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pllua_profile_stop()
+  RETURNS VOID AS 'MODULE_PATHNAME', 'pllua_profile_stop'
+  LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pllua_profile_results(OUT stack text, OUT samples bigint)
+  RETURNS SETOF record AS 'MODULE_PATHNAME', 'pllua_profile_results'
+  LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION pllua_profile_start(integer) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pllua_profile_stop() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pllua_profile_results() FROM PUBLIC;
+
+CREATE FUNCTION pllua_function_stats(OUT funcid oid,
+                                     OUT calls bigint,
+                                     OUT compile_time float8,
+                                     OUT args_time float8,
+                                     OUT lua_time float8,
+                                     OUT spi_time float8,
+                                     OUT result_time float8,
+                                     OUT gc_time float8,
+                                     OUT alloc_bytes bigint,
+                                     OUT subxacts bigint)
+  RETURNS SETOF record AS 'MODULE_PATHNAME', 'pllua_function_stats'
+  LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pllua_function_stats_reset()
+  RETURNS VOID AS 'MODULE_PATHNAME', 'pllua_function_stats_reset'
+  LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION pllua_function_stats() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pllua_function_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION pllua_interpreters(OUT user_id oid,
+                                   OUT trusted boolean,
+                                   OUT lua_heap_bytes bigint,
+                                   OUT context_bytes bigint,
+                                   OUT error_context_bytes bigint,
+                                   OUT functions bigint,
+                                   OUT types bigint,
+                                   OUT record_types bigint,
+                                   OUT cursors bigint,
+                                   OUT datums bigint,
+                                   OUT gc_debt bigint)
+  RETURNS SETOF record AS 'MODULE_PATHNAME', 'pllua_interpreters'
+  LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION pllua_interpreters() FROM PUBLIC;
+
+--
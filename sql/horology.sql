@@ -249,6 +249,17 @@ do language pllua $$
   end
 $$;
 
+-- field values are cached, but must follow changes of timezone
+
+do language pllua $$
+  local t = pgtype.timestamptz('2019-04-22 10:20:30.5+00')
+  print(t.hour, t.minute, t.second, t.timezone, t:as_table().timezone_abbrev)
+  spi.execute([[set timezone = 'Asia/Kathmandu']])
+  print(t.hour, t.minute, t.second, t.timezone, t:as_table().timezone_abbrev)
+  local d = pgtype.date('0001-12-31 BC')
+  print(d.year, d.month, d.day, d.hour, d.doy, d.dow, d.isodow)
+$$;
+
 set timezone = 'UTC';
 
 do language pllua $$
@@ -314,4 +325,24 @@ do language pllua $$
   end
 $$;
 
+-- 4. Conversion to and from epoch microseconds
+
+do language pllua $$
+  local tm = require 'pllua.time'
+  local t = tm.from_epoch_usec(1555891200123456)
+  print(t, tm.to_epoch_usec(t) == 1555891200123456)
+  print(tm.from_epoch_usec(1555891200123456, 'America/Los_Angeles'))
+  print(tm.from_epoch_usec(-1, 3600), tm.from_epoch_usec(0, true))
+  print(tm.from_epoch_usec(math.huge), tm.to_epoch_usec(tm.from_epoch_usec(-math.huge)))
+  print(tm.to_epoch_usec(pgtype.timestamp('1968-05-10 03:45:01.234567')))
+  local a = tm.from_epoch_usec_array({ 0, 1555891200000000, nil, -1 }, 4)
+  print(a)
+  local v, n = tm.to_epoch_usec_array(a)
+  print(n, v[1], v[2] == 1555891200000000, v[3], v[4])
+  print(tm.from_epoch_usec_array({}), select(2, tm.to_epoch_usec_array(pgtype.array.timestamp())))
+$$;
+
+do language pllua $$ print(require('pllua.time').from_epoch_usec(1.5)) $$;
+do language pllua $$ print(require('pllua.time').from_epoch_usec(-300000000000000000)) $$;
+
 --end
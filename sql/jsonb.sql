@@ -118,4 +118,54 @@ do language pllua $$
   print(j_out)
 $$;
 
+-- test lazy path access
+
+do language pllua $$
+  local j = pgtype.jsonb('{"a":{"b":[10,"x",{"c":true}]},"n":null,"s":"str"}')
+  print(j:get("a","b",0), j:get("a","b",1), j:get("a","b",-1))
+  print(j:get("a","b",2,"c"), j:get("a","b",3), j:get("a","x"))
+  print(j:get("s"), j:get("n"), j:get("s","x"))
+  print(j:has("n"), j:has("a","b",2), j:has("a","b",5), j:has("zz"))
+  print(pgtype.jsonb('"foo"'):get(), rawequal(j:get(), j))
+  print(pcall(function() return j.s end))
+  print(pcall(function() return type(j.get) end))
+$$;
+
+-- test shape hints
+
+do language pllua $$
+  local jsonb = require 'pllua.jsonb'
+  local shp = jsonb.shape{ "name", "id", "amount", "id" }
+  print(jsonb.is_object(setmetatable({}, shp)))
+  local rows = {}
+  for i = 1,3 do
+    rows[i] = setmetatable({ id = i, name = "n"..i, amount = (i ~= 2) and i*1.5 or nil, extra = 1 }, shp)
+  end
+  print(pgtype.jsonb(rows))
+  print(pgtype.jsonb({ [1]="a", [3]="c", [2]="b" }))
+  print(pgtype.jsonb({ 10, 20, 30, [5] = 50 }))
+  print(pgtype.jsonb({ rows[2], setmetatable({}, shp) }, { empty_object = true }))
+  print(pcall(jsonb.shape, { "id", 1 }))
+$$;
+
+-- test json text parsing
+
+do language pllua $$
+  local jsonb = require 'pllua.jsonb'
+  local t = jsonb.from_json('{"b":[1,2.5,"x",true,null,{}],"a":{"c":false},"b":"dup"}')
+  print(t.b, t.a.c, jsonb.is_object(t.a))
+  local t2 = jsonb.from_json(pgtype.json('[1, 2.5, "x", null, [3]]'), { null = "NULL" })
+  print(jsonb.is_array(t2), t2[1], t2[2], t2[3], t2[4], t2[5][1])
+  print(pgtype.jsonb(jsonb.from_json('{"k":[1,{"z":null}]}', { pg_numeric = true })))
+  print(jsonb.from_json('"scalar"'), jsonb.from_json('12'))
+  jsonb.scan_json('{"a":[1,"two",null,{"b":true}]}',
+                  { object_start = function() print("{") end,
+                    object_end = function() print("}") end,
+                    array_start = function() print("[") end,
+                    array_end = function() print("]") end,
+                    key = function(k) print("key",k) end,
+                    scalar = function(v,t) print("scalar",v,t) end })
+  print((pcall(jsonb.from_json, '{"a":')))
+$$;
+
 --end
@@ -0,0 +1,25 @@
+--
+
+\set VERBOSITY terse
+
+--
+
+-- test jsonb.path (pg12+)
+
+do language pllua $$
+  local jsonb = require 'pllua.jsonb'
+  local j = pgtype.jsonb('{"items":[{"id":1,"tags":["a","b"]},{"id":2,"tags":[]},{"id":3,"tags":["c"]}],"n":null}')
+  local p = jsonb.path('$.items[*] ? (@.id > $min).id', { min = 1 })
+  print(p)
+  for i,v in p(j) do print(i,v) end
+  print(p:array(j))
+  print(p:first(j), p:exists(j))
+  local q = jsonb.path('$.items[*].tags')
+  for i,v in q:query(j) do print(i, jsonb.type(v), v) end
+  print(jsonb.path('$.nosuch'):first(j), jsonb.path('$.nosuch'):exists(j))
+  print(jsonb.path('$.n'):first(j), jsonb.path('$.items[0]'):first(j))
+  print(jsonb.path('strict $.nosuch', nil, true):exists(j))
+  print((pcall(jsonb.path, '$.[')))
+$$;
+
+--end
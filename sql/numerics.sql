@@ -90,6 +90,70 @@ do language pllua $$
   print(pi())
 $$;
 
+-- check arithmetic on small values, including scale handling and fallbacks
+
+do language pllua $$
+  local num = require 'pllua.numeric'
+  local a, b, z = pgtype.numeric('12.50'), pgtype.numeric('-0.125'), pgtype.numeric('0.000')
+  print(a + b, a - b, a * b, -b, a + 1, 2 * b)
+  print(a + (-a), z + z, z * a, -z)
+  print(pgtype.numeric('-1.5') + pgtype.numeric('1.25'), pgtype.numeric('10000') * pgtype.numeric('0.0001'), pgtype.numeric('123456789.123456789') - 1)
+  print(a == pgtype.numeric('12.5'), a < b, b <= a, b < 0, num.equal(a, 12.5))
+  local big = pgtype.numeric('999999999999999999')
+  print(big + 1, big * big, pgtype.numeric('0.000000000000001') * pgtype.numeric('0.1'))
+  local acc = pgtype.numeric(0)
+  for i = 1,1000 do acc = acc + pgtype.numeric('0.01') end
+  print(acc)
+$$;
+
+-- check small-value arithmetic on values read from table rows, which keep
+-- their packed short varlena headers
+
+create temp table numtst (id integer, amount numeric(10,2));
+insert into numtst select i, i * 1.25 - 3 from generate_series(1,20) i;
+do language pllua $$
+  local acc = pgtype.numeric(0)
+  for r in spi.rows([[ select amount from numtst order by id ]]) do
+    acc = acc + r.amount
+  end
+  local rows = spi.execute([[ select amount from numtst order by id ]])
+  local a, b, c, d = rows[1].amount, rows[2].amount, rows[3].amount, rows[4].amount
+  print(acc, a - b, c * d, -a, a < b, a == pgtype.numeric('-1.75'))
+$$;
+
+-- check aggregation functions
+
+do language pllua $$
+  local num = require 'pllua.numeric'
+  local arr = pgtype.array.numeric:fromstring('{1.5,2,NULL,3.25,-10}')
+  print(num.sum(arr), num.avg(arr), num.minmax(arr))
+  local t = { 1, pgtype.numeric('0.10'), '2.005', 4.5 }
+  print(num.sum(t), num.avg(t), num.minmax(t))
+  local function gen(n)
+    local i = 0
+    return function() i = i + 1 if i <= n then return pgtype.numeric(i) / 4 end end
+  end
+  print(num.sum(gen(10)), num.avg(gen(10)), num.minmax(gen(10)))
+  print(num.sum({}), num.avg({}), num.minmax({}))
+  print(num.sum({ pgtype.numeric('999999999999999999'), 1, pgtype.numeric('NaN') }),
+        num.sum({ pgtype.numeric('999999999999999999'), 1 }))
+$$;
+
+-- check aggregation over values read from table rows
+
+do language pllua $$
+  local num = require 'pllua.numeric'
+  local t = {}
+  for r in spi.rows([[ select amount from numtst order by id ]]) do
+    t[#t+1] = r.amount
+  end
+  print(num.sum(t), num.avg(t), num.minmax(t))
+  local i = 0
+  print(num.sum(function() i = i + 1 return t[i] end))
+  local arr = spi.execute([[ select array_agg(amount order by id) as a from numtst ]])[1].a
+  print(num.sum(arr), num.avg(arr), num.minmax(arr))
+$$;
+
 -- check sanity of maxinteger/mininteger
 
 do language pllua $$
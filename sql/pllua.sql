@@ -181,4 +181,49 @@ do language pllua $$
   print((lpcall(require,"io")))
 $$;
 
+-- per-call resource limits
+set pllua.max_instructions_per_call = 1000;
+do language pllua $$
+  local ok, e = pcall(function() local n = 0 for i = 1,1e7 do n = n + i end end)
+  print(ok, e)
+  ok, e = pcall(function() for i = 1,1e7 do end end)
+  print(ok, e)
+$$;
+do language pllua $$
+  local ok, ok2, e = pcall(pcall, function() for i = 1,1e7 do end end)
+  print(ok, ok2, e)
+$$;
+reset pllua.max_instructions_per_call;
+set pllua.max_time_per_call = 10;
+do language pllua $$
+  print(pcall(function() for i = 1,1e10 do end end))
+$$;
+reset pllua.max_time_per_call;
+
+-- sampling profiler
+select pllua_profile_start(100);
+do language pllua $$
+  local function hot(n) local s = 0 for i = 1,n do s = s + i end return s end
+  print(hot(1000000))
+$$;
+select pllua_profile_stop();
+select count(*) > 0 from pllua_profile_results()
+ where stack like '%hot@DO-block:2';
+
+-- function execution statistics
+set pllua.track_function_stats = on;
+create function pg_temp.stats1(n integer) returns integer language pllua
+  as $$ local r = spi.execute("select $1::integer + 1 as x", n) return r[1].x $$;
+select pg_temp.stats1(i) from generate_series(1,3) i;
+reset pllua.track_function_stats;
+select calls, compile_time >= 0 as c, spi_time > 0 as s, alloc_bytes > 0 as a
+  from pllua_function_stats() where funcid = 'pg_temp.stats1'::regproc;
+select pllua_function_stats_reset();
+select count(*) from pllua_function_stats()
+ where funcid = 'pg_temp.stats1'::regproc;
+
+-- interpreter inventory
+select trusted, lua_heap_bytes > 0 as h, datums >= 0 as d
+  from pllua_interpreters() order by trusted;
+
 --end
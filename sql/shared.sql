@@ -0,0 +1,25 @@
+--
+
+\set VERBOSITY terse
+
+--
+
+-- test pllua.shared (pg15+). The regression database doesn't preload
+-- pllua, so only argument checks and the not-available error can be
+-- tested here; t/001_shared.pl tests the store itself.
+
+do language plluau $$
+  local shared = require 'pllua.shared'
+  local function try(f, ...) print(select(2, pcall(f, ...))) end
+  try(shared.get, string.rep("x", 64))
+  try(shared.set, "a\0b", 1)
+  try(shared.set, "k", { a = { 1 } })
+  try(shared.set, "k", { f = print })
+  try(shared.set, "k", print)
+  try(shared.get, string.rep("x", 63))
+  try(shared.set, "k", { 1, 2.5, "x", true, n = 3 })
+  try(shared.keys)
+  try(shared.version)
+$$;
+
+--end
@@ -175,6 +175,35 @@ do language pllua $$
   print(#r1)
 $$;
 
+-- check try_execute
+do language pllua $$
+  local q = [[ select 10/i as x from generate_series($1::integer,$2) i ]]
+  local r, e = spi.try_execute(q, 1, 3)
+  print(#r, e)
+  print(spi.try_execute(q, 0, 3))
+  print(spi.try_execute([[ update tsttab set id = id where false ]]))
+  print(spi.try_execute([[ with d as (insert into tsttab(id) values (-1) returning id)
+                           select 1/(id+1) from d ]]))
+  print(#spi.execute([[ select * from tsttab where id = -1 ]]))
+  local s = spi.prepare([[ select 10/$1::integer as x ]])
+  print(s:try_execute(5)[1].x)
+  print(s:try_execute(0))
+  print(s:try_execute(2)[1].x)
+$$;
+
+-- check execute_tables
+do language pllua $$
+  local q = [[ select id, b, c, null::integer as n from tsttab where id < $1 order by id ]]
+  local r = spi.execute_tables(q, 3)
+  print(#r, r.n, type(r[1]), getmetatable(r[1]) == getmetatable(r[2]))
+  for i = 1, #r do print(r[i].id, r[i][2], r[i].c, r[i].n, r[i][4]) end
+  r[1].b = 'changed'
+  print(r[1][2], pcall(function() r[1].nosuch = 1 end))
+  print(pcall(function() return r[1].nosuch end))
+  local s = spi.prepare([[ select $1::integer as x, $1::text as y ]])
+  print(s:execute_tables(7)[1].x, s:execute_tables(7)[1].y)
+$$;
+
 -- cursors as parameters and return values
 
 create function do_fetch(c refcursor) returns void language pllua as $$
@@ -145,4 +145,49 @@ do language pllua $$
   print(err.type(e), err.category(e), err.errcode(e), e)
 $$;
 
+-- subxacts are only started on first database access, but nested
+-- pending ones must still be started in the right order
+
+truncate table xatst;
+do language pllua $$
+  local stmt = spi.prepare([[ insert into xatst values ($1) ]]);
+  print(pcall(function()
+    print(pcall(function() error("pure lua") end))
+    print(pcall(function()
+      stmt:execute(1)
+      print(pcall(function() stmt:execute(2) error("inner") end))
+      error("outer")
+    end))
+    stmt:execute(3)
+  end))
+$$;
+select a from xatst order by a;
+
+-- a pcall around code that never touches the database starts no
+-- subtransaction; nested ones that do are counted once each
+
+set pllua.track_function_stats = on;
+create function pg_temp.sxcount(n integer) returns void language pllua as $$
+  for i = 1,n do assert(pcall(function() return i * 2 end)) end
+  assert(pcall(function()
+    assert(pcall(function() spi.execute("select 1") end))
+  end))
+$$;
+select pg_temp.sxcount(10);
+reset pllua.track_function_stats;
+select calls, subxacts from pllua_function_stats()
+ where funcid = 'pg_temp.sxcount'::regproc;
+
+-- an error raised outside the database, such as a call limit, must
+-- still be catchable by a pcall whose subxact is still pending
+
+truncate table xatst;
+set pllua.max_instructions_per_call = 10000;
+do language pllua $$
+  spi.execute("insert into xatst values (1)")
+  print(pcall(function() for i = 1,1e7 do end end))
+$$;
+reset pllua.max_instructions_per_call;
+select a from xatst order by a;
+
 --end
@@ -247,6 +247,48 @@ select * from trigtst order by id;
 
 drop trigger t1 on trigtst;
 
+-- in-place column access; trigger body doesn't mention old/new args
+create function modtrig12() returns trigger language pllua
+as $$
+  print(trigger.name, trigger:old_value("name"), trigger:old_value(4), trigger:new_value("qty"))
+  if trigger:old_value("flag") ~= trigger:new_value("flag") then
+    trigger.row.qty = 0
+    print(trigger:new_value("qty"), trigger:old_value("qty"), trigger.new.qty)
+  end
+  print(pcall(trigger.new_value, trigger, "nosuchcol"))
+$$;
+
+create trigger t1
+  before update on trigtst
+  for each row
+  execute procedure modtrig12();
+
+update trigtst set qty = 50 where name = 'florence';
+update trigtst set flag = true where name = 'florence';
+select * from trigtst where name = 'florence';
+
+drop trigger t1 on trigtst;
+
+-- partial rebuild of modified rows
+create table trigtst3 (id integer, big text, arr integer[], n numeric(6,2), ts text);
+create function modtrig13() returns trigger language pllua
+as $$
+  new.ts = 'touched'
+  new.n = 1.234
+  if new.id == 2 then new.arr[2] = 5 end
+  if new.id == 3 then return new end
+$$;
+create trigger t1
+  before update on trigtst3
+  for each row
+  execute procedure modtrig13();
+insert into trigtst3
+  select i, repeat(md5(i::text), 10000), array[1,2,3], 0, null
+    from generate_series(1,3) i;
+update trigtst3 set id = id;
+select id, length(big), md5(big) = md5(repeat(md5(id::text), 10000)) as big_ok, arr, n, ts
+  from trigtst3 order by id;
+
 -- table with one column exercises several edge cases:
 
 create table trigtst1col (col integer);
@@ -66,4 +66,25 @@ insert into trigtst2
 update trigtst2 set qty = qty + 1;
 delete from trigtst2 where name = 'sheila';
 
+-- direct access to transition tables
+
+create function ttrig4() returns trigger language pllua
+as $$
+  print(trigger.name, trigger.old_table ~= nil, trigger.new_table ~= nil)
+  for r in trigger.old_table() do print('old', r.id, r.name, r.qty) end
+  for rows in trigger.new_table(3) do
+    print('batch', #rows)
+    for i,r in ipairs(rows) do print('new', r.id, r.name, r.qty) end
+  end
+$$;
+
+create trigger t4
+  after update on trigtst2
+  referencing old table as oldtab
+              new table as newtab
+  for each statement
+  execute procedure ttrig4();
+
+update trigtst2 set qty = qty - 1 where id <= 5;
+
 --
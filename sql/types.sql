@@ -202,4 +202,18 @@ do language pllua $$
   print(pgtype.ctype3(1,2))
 $$;
 
+
+-- column slots
+
+do language pllua $$
+  local t = pgtype.ctype3
+  local f, j = t:slot("fred"), t:slot(2)
+  local r = t(1,2)
+  print(r[f], r[j])
+  r[j] = 4.5
+  print(r, r.jim, r[f] == r.fred)
+  print(pcall(function() return pgtype.ctype2(1,2)[f] end))
+  print(pcall(t.slot, t, "nosuchcol"))
+$$;
+
 --end
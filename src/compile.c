@@ -332,6 +332,50 @@ pllua_resolve_activation(lua_State *L,
 	act->resolved = true;
 }
 
+/*
+ * Might the function source refer to the given name as a variable? This is a
+ * crude lexical check that doesn't know about strings or comments, and it
+ * only excludes field and method names (as in "trigger.new"), so it errs on
+ * the side of saying yes.
+ *
+ * Used to avoid building the old and new rows for trigger functions that
+ * never look at their "old" and "new" parameters.
+ */
+static bool
+pllua_source_mentions(text *src, const char *name)
+{
+	const char *str = VARDATA_ANY(src);
+	size_t		len = VARSIZE_ANY_EXHDR(src);
+	size_t		namelen = strlen(name);
+	size_t		i;
+
+#define PLLUA_ISIDENT(c_) (isalnum((unsigned char) (c_)) || (c_) == '_')
+
+	for (i = 0; i + namelen <= len; ++i)
+	{
+		size_t		j = i;
+
+		if (str[i] != name[0]
+			|| memcmp(str + i, name, namelen) != 0
+			|| (i > 0 && PLLUA_ISIDENT(str[i-1]))
+			|| (i + namelen < len && PLLUA_ISIDENT(str[i+namelen])))
+			continue;
+
+		/* skip back over whitespace to see if it's "x.name" or "x:name" */
+		while (j > 0 && isspace((unsigned char) str[j-1]))
+			--j;
+		if (j > 0 && str[j-1] == ':')
+			continue;
+		if (j > 0 && str[j-1] == '.' && !(j > 1 && str[j-2] == '.'))
+			continue;
+		return true;
+	}
+
+#undef PLLUA_ISIDENT
+
+	return false;
+}
+
 /*
  * Load up our func_info and comp_info structures from the function's catalog
  * entry.
@@ -406,6 +450,11 @@ pllua_load_from_proctup(lua_State *L,
 	comp_info->prosrc = DatumGetTextPP(psrc);
 	comp_info->validate_only = false;
 
+	func_info->trigger_rows_used =
+		func_info->is_trigger &&
+		(pllua_source_mentions(comp_info->prosrc, "old") ||
+		 pllua_source_mentions(comp_info->prosrc, "new"));
+
 	/*
 	 * Compile needs the allargs list (to get names and modes) as well as the
 	 * runtime (IN only) argtypes list set above.
@@ -491,6 +540,7 @@ pllua_validate_and_push(lua_State *L,
 			MemoryContext fcxt;
 			MemoryContext ccxt;
 			HeapTuple	procTup;
+			uint32		wait_event;
 
 			/* Get the pg_proc tuple. */
 			procTup = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
@@ -585,10 +635,16 @@ pllua_validate_and_push(lua_State *L,
 			 * in turn recurse here. We trust that stack depth checks will
 			 * break any such loop if need be.
 			 */
+			wait_event = pllua_phase_begin(PLLUA_PHASE_COMPILE);
+			PLLUA_PROBE1(compile__start, fn_oid);
+
 			pllua_pushcfunction(L, pllua_compile);
 			lua_pushlightuserdata(L, comp_info);
 			rc = pllua_pcall_nothrow(L, 1, 1, 0);
 
+			PLLUA_PROBE1(compile__done, fn_oid);
+			pllua_phase_end(wait_event);
+
 			MemoryContextSwitchTo(oldcontext);
 			MemoryContextDelete(ccxt);
 
@@ -666,6 +666,12 @@ static void pllua_datum_reference(lua_State *L, int nd)
 static int pllua_datum_gc(lua_State *L)
 {
 	pllua_datum *p = lua_touserdata(L, 1);
+	pllua_interpreter *interp;
+	pllua_typeinfo *t = NULL;
+	Size		sz;
+
+	if (p)
+		--pllua_getinterpreter(L)->ndatums;
 
 	if (!p || !p->need_gc || !DatumGetPointer(p->value))
 		return 0;
@@ -676,6 +682,14 @@ static int pllua_datum_gc(lua_State *L)
 	 * Don't retry if something goes south.
 	 */
 	p->need_gc = false;
+	interp = pllua_getinterpreter(L);
+
+	if (lua_getmetatable(L, 1))
+	{
+		lua_getfield(L, -1, "typeinfo");
+		t = pllua_totypeinfo(L, -1);
+		lua_pop(L, 2);
+	}
 
 	/*
 	 * Remove our metatable. There are ways (using keys of ephemeron tables)
@@ -685,27 +699,74 @@ static int pllua_datum_gc(lua_State *L)
 	lua_pushnil(L);
 	lua_setmetatable(L, 1);
 
+	/*
+	 * Rather than enter pg context for every finalized datum, which is costly
+	 * when a GC cycle is finalizing thousands of them, queue the value and
+	 * free a batch at a time. Nothing else can be referring to the value:
+	 * dependent child datums don't own their storage and hold a reference to
+	 * the parent. The queue is flushed early once enough bytes are in it, so
+	 * that large values aren't held for long.
+	 *
+	 * Expanded objects, and anything we can't size, are assumed to be big.
+	 */
+	if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(p->value)) || !t)
+		sz = PLLUA_PENDING_FREE_BYTES;
+	else if (t->typlen == -1)
+		sz = VARSIZE_ANY(DatumGetPointer(p->value));
+	else if (t->typlen == -2)
+		sz = strlen(DatumGetCString(p->value)) + 1;
+	else
+		sz = t->typlen;
+
+	interp->pending_free[interp->npending_free++] = p->value;
+	interp->pending_free_bytes += sz;
+	if (interp->npending_free >= PLLUA_PENDING_FREE_SIZE
+		|| interp->pending_free_bytes >= PLLUA_PENDING_FREE_BYTES)
+		pllua_free_pending_datums(L);
+
+	return 0;
+}
+
+/*
+ * Free datum values queued by pllua_datum_gc. Called when the queue fills,
+ * from collectgarbage(), and on exit from each call.
+ */
+void pllua_free_pending_datums(lua_State *L)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+
+	if (interp->npending_free == 0)
+		return;
+
+	ASSERT_LUA_CONTEXT;
+
+	interp->pending_free_bytes = 0;
+
 	PLLUA_TRY();
 	{
-		if (VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(p->value)))
-		{
-			pllua_debug(L, "pllua_datum_gc: expanded object %p", DatumGetPointer(p->value));
-			DeleteExpandedObject(p->value);
-		}
-		else if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(p->value)))
+		/* decrement first so that we don't retry if something goes south */
+		while (interp->npending_free > 0)
 		{
-			/* how'd this get here? */
-			elog(ERROR, "unexpected expanded datum");
-		}
-		else
-		{
-			pllua_debug(L, "pllua_datum_gc: flat object %p", DatumGetPointer(p->value));
-			pfree(DatumGetPointer(p->value));
+			Datum		value = interp->pending_free[--interp->npending_free];
+
+			if (VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(value)))
+			{
+				pllua_debug(L, "pllua_datum_gc: expanded object %p", DatumGetPointer(value));
+				DeleteExpandedObject(value);
+			}
+			else if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(value)))
+			{
+				/* how'd this get here? */
+				elog(ERROR, "unexpected expanded datum");
+			}
+			else
+			{
+				pllua_debug(L, "pllua_datum_gc: flat object %p", DatumGetPointer(value));
+				pfree(DatumGetPointer(value));
+			}
 		}
 	}
 	PLLUA_CATCH_RETHROW();
-
-	return 0;
 }
 
 pllua_typeinfo *pllua_totypeinfo(lua_State *L, int nd)
@@ -862,6 +923,8 @@ pllua_datum *pllua_newdatum(lua_State *L, int nt, Datum value)
 	lua_setmetatable(L, -2);
 	lua_remove(L, -2);
 
+	++pllua_getinterpreter(L)->ndatums;
+
 	return d;
 }
 
@@ -1547,6 +1610,33 @@ static int pllua_datum_row_tostring(lua_State *L)
 
 
 
+/*
+ * Column slot keys, see pllua_typeinfo_slot. The slot's uservalue holds a
+ * reference to the typeinfo object, so the typeinfo can't be freed (and its
+ * address reused by some other one) while the slot exists, which makes the
+ * pointer comparison here sufficient.
+ */
+typedef struct pllua_colslot
+{
+	pllua_typeinfo *t;
+	int			attno;
+} pllua_colslot;
+
+/*
+ * Map the slot at nd back to its attno, or return 0 if it's not a slot at
+ * all.
+ */
+static int pllua_typeinfo_slot_attno(lua_State *L, pllua_typeinfo *t, int nd)
+{
+	pllua_colslot *slot = pllua_toobject(L, nd, PLLUA_COLSLOT_OBJECT);
+
+	if (!slot)
+		return 0;
+	if (slot->t != t)
+		luaL_error(L, "column slot does not belong to this row type");
+	return slot->attno;
+}
+
 static void pllua_datum_getattrs(lua_State *L, int nd)
 {
 	if (luaL_getmetafield(L, nd, "attrs") != LUA_TTABLE)
@@ -1574,6 +1664,16 @@ static int pllua_datum_row_index(lua_State *L)
 			lua_pushnil(L);
 			return 1;
 
+		case LUA_TUSERDATA:
+			attno = pllua_typeinfo_slot_attno(L, t, 2);
+			if (attno == 0)
+			{
+				lua_pushnil(L);
+				return 1;
+			}
+			lua_pushinteger(L, attno);
+			goto have_attno;
+
 		case LUA_TSTRING:
 			pllua_datum_getattrs(L, 1);
 			/* stack: attrs{ attname = attno } */
@@ -1583,6 +1683,7 @@ static int pllua_datum_row_index(lua_State *L)
 			FALLTHROUGH; /*FALLTHROUGH*/
 
 		case LUA_TNUMBER:		/* column number */
+		have_attno:
 			attno = lua_tointeger(L, -1);
 			if (IsObjectIdAttributeNumber(attno))
 			{
@@ -1601,6 +1702,56 @@ static int pllua_datum_row_index(lua_State *L)
 	}
 }
 
+/*
+ * Record that column "attno" of the row datum at nd is being assigned to; or,
+ * if attno is 0, that the row is being changed in some way we don't track
+ * (such as a change to a nested value). Changes to nested values are recorded
+ * against the outermost row, as unknown.
+ *
+ * The ".changed" field of the row is a table of changed attnos, or "true"
+ * if we can't tell; see pllua_datum_modify_tuple. This must be called before
+ * exploding the row, since that drops the references to parent rows.
+ */
+static void pllua_datum_note_change(lua_State *L, int nd, int attno)
+{
+	lua_pushvalue(L, nd);
+	while (pllua_get_user_field(L, -1, ".datumref") != LUA_TNIL)
+	{
+		lua_remove(L, -2);
+		attno = 0;
+	}
+	lua_pop(L, 1);
+	/* stack top is now the outermost row */
+
+	if (attno <= 0)
+	{
+		lua_pushboolean(L, 1);
+		pllua_set_user_field(L, -2, ".changed");
+	}
+	else
+	{
+		switch (pllua_get_user_field(L, -1, ".changed"))
+		{
+			case LUA_TTABLE:
+				break;
+			case LUA_TNIL:
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushvalue(L, -1);
+				pllua_set_user_field(L, -3, ".changed");
+				break;
+			default:
+				/* already unknown */
+				lua_pop(L, 2);
+				return;
+		}
+		lua_pushboolean(L, 1);
+		lua_rawseti(L, -2, attno);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
 /*
  * __newindex(self,key,val)   self[key] = val
  */
@@ -1621,6 +1772,14 @@ static int pllua_datum_row_newindex(lua_State *L)
 		default:
 			luaL_error(L, "invalid type for key field");
 
+		case LUA_TUSERDATA:
+			attno = pllua_typeinfo_slot_attno(L, t, 2);
+			if (attno == 0)
+				luaL_error(L, "invalid type for key field");
+			lua_pushinteger(L, attno);
+			lua_replace(L, 2);
+			goto have_attno;
+
 		case LUA_TSTRING:
 			pllua_datum_getattrs(L, 1);
 			/* stack: attrs{ attname = attno } */
@@ -1631,6 +1790,7 @@ static int pllua_datum_row_newindex(lua_State *L)
 			FALLTHROUGH; /*FALLTHROUGH*/
 
 		case LUA_TNUMBER:		/* column number */
+		have_attno:
 			attno = lua_tointeger(L, 2);
 			if (IsObjectIdAttributeNumber(attno))
 			{
@@ -1640,6 +1800,7 @@ static int pllua_datum_row_newindex(lua_State *L)
 			else if ((attno < 1 || attno > t->natts)
 					 || TupleDescAttr(t->tupdesc, attno-1)->attisdropped)
 				luaL_error(L, "datum has no column number %d", attno);
+			pllua_datum_note_change(L, 1, IsObjectIdAttributeNumber(attno) ? 0 : (int) attno);
 			pllua_datum_explode_tuple(L, 1, d, t);
 			if (IsObjectIdAttributeNumber(attno))
 			{
@@ -1941,6 +2102,10 @@ static int pllua_datum_idxlist_pairs(lua_State *L)
 	return 3;
 }
 
+static struct luaL_Reg colslot_mt[] = {
+	{ NULL, NULL }
+};
+
 static struct luaL_Reg idxlist_mt[] = {
 	{ "__index", pllua_datum_idxlist_index },
 	{ "__newindex", pllua_datum_idxlist_newindex },
@@ -2075,6 +2240,7 @@ static int pllua_datum_array_newindex(lua_State *L)
 	{
 		pllua_typeinfo *parent_t;
 		pllua_datum *parent_d = pllua_checkanydatum(L, -1, &parent_t);
+		pllua_datum_note_change(L, 1, 0);
 		pllua_datum_explode_tuple(L, -2, parent_d, parent_t);
 		lua_pop(L, 3);
 	}
@@ -3219,6 +3385,56 @@ static int pllua_typeinfo_element(lua_State *L)
 		return 0;
 }
 
+/*
+ * typeinfo:slot(col)
+ *
+ * Returns a key which can be used in place of the column name or number to
+ * index rows of this type, resolving the name once rather than on every
+ * access. The key is a small userdata holding the attno and anchored to the
+ * typeinfo object, so it stays tied to this version of the type even if the
+ * type is later altered.
+ */
+static int pllua_typeinfo_slot(lua_State *L)
+{
+	pllua_typeinfo *t = pllua_checktypeinfo(L, 1, true);
+	lua_Integer attno = 0;
+	pllua_colslot *slot;
+
+	if (!t->tupdesc)
+		luaL_error(L, "type is not a row type");
+
+	lua_settop(L, 2);
+
+	switch (lua_type(L, 2))
+	{
+		default:
+			luaL_argerror(L, 2, "expected string or number");
+
+		case LUA_TSTRING:
+			pllua_get_user_field(L, 1, "attrs");
+			/* stack: attrs{ attname = attno } */
+			lua_pushvalue(L, 2);
+			if (lua_gettable(L, -2) != LUA_TNUMBER)
+				luaL_error(L, "type has no column \"%s\"", lua_tostring(L, 2));
+			FALLTHROUGH; /*FALLTHROUGH*/
+
+		case LUA_TNUMBER:		/* column number */
+			attno = lua_tointeger(L, -1);
+			if ((attno < 1 || attno > t->natts)
+				|| TupleDescAttr(t->tupdesc, attno-1)->attisdropped)
+				luaL_error(L, "type has no column number %d", attno);
+	}
+
+	slot = pllua_newobject(L, PLLUA_COLSLOT_OBJECT, sizeof(pllua_colslot), true);
+	slot->t = t;
+	slot->attno = (int) attno;
+	lua_getuservalue(L, -1);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_pop(L, 1);
+	return 1;
+}
+
 static int pllua_dump_typeinfo(lua_State *L)
 {
 	pllua_typeinfo *obj = pllua_checktypeinfo(L, 1, false);
@@ -3858,6 +4074,113 @@ static void pllua_typeinfo_coerce_typmod(lua_State *L,
 	lua_pop(L, 1);
 }
 
+/*
+ * Given a row datum at nd which was made from "tuple" and has since been
+ * modified only by assigning to its own columns, return a copy of the tuple
+ * (in the current memory context) with just those columns replaced, as
+ * heap_modify_tuple does. Unchanged columns, including toasted ones, are
+ * taken from the original tuple untouched, rather than from our exploded
+ * copies of them.
+ *
+ * Returns NULL if we can't be sure what changed; the caller must then form
+ * the whole tuple from the datum.
+ */
+HeapTuple
+pllua_datum_modify_tuple(lua_State *L, int nd, HeapTuple tuple)
+{
+	int			base = lua_gettop(L);
+	pllua_typeinfo *t;
+	pllua_datum *d;
+	Datum		values[MaxTupleAttributeNumber + 1];
+	bool		isnull[MaxTupleAttributeNumber + 1];
+	bool		replace[MaxTupleAttributeNumber + 1];
+	volatile HeapTuple result = NULL;
+	int			natts;
+	int			i;
+
+	nd = lua_absindex(L, nd);
+	d = pllua_toanydatum(L, nd, &t);
+	if (!d)
+		return NULL;
+	if (t->natts < 0 || !d->modified
+		|| pllua_get_user_field(L, nd, ".changed") != LUA_TTABLE
+		|| pllua_get_user_field(L, nd, ".deformed") != LUA_TTABLE)
+		goto fail;
+
+	/* stack: typeinfo changed deformed */
+
+	natts = t->natts;
+	memset(replace, 0, natts * sizeof(bool));
+	lua_pushnil(L);
+	while (lua_next(L, base + 2))
+	{
+		lua_Integer attno = lua_tointeger(L, -2);
+		lua_pop(L, 1);
+		if (attno < 1 || attno > natts)
+			goto fail;
+		replace[attno-1] = true;
+	}
+
+	for (i = 0; i < natts; ++i)
+	{
+		Form_pg_attribute att = TupleDescAttr(t->tupdesc, i);
+
+		switch (lua_rawgeti(L, base + 3, i+1))
+		{
+			case LUA_TUSERDATA:
+				{
+					pllua_typeinfo *et;
+					pllua_datum *ed = pllua_toanydatum(L, -1, &et);
+
+					/*
+					 * A column value that has itself been modified in place
+					 * (which can happen to arrays, or to rows that were
+					 * assigned in and then changed) means we can't trust the
+					 * change list.
+					 */
+					if (!ed || ed->modified
+						|| (et->is_array
+							&& VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(ed->value))
+							&& !replace[i]))
+						goto fail;
+					if (replace[i])
+					{
+						if (et->typeoid != att->atttypid)
+							goto fail;
+						values[i] = ed->value;
+						isnull[i] = false;
+						if (att->atttypid != RECORDOID && att->atttypmod >= 0
+							&& att->atttypmod != ed->typmod)
+							pllua_typeinfo_coerce_typmod(L, &values[i], &isnull[i],
+														 -1, et, att->atttypmod);
+					}
+					lua_pop(L, 1);
+				}
+				break;
+			case LUA_TNIL:
+			case LUA_TBOOLEAN:
+				values[i] = (Datum) 0;
+				isnull[i] = true;
+				break;
+			default:
+				if (replace[i])
+					goto fail;
+				break;
+		}
+		lua_pop(L, 1);
+	}
+
+	PLLUA_TRY();
+	{
+		result = heap_modify_tuple(tuple, t->tupdesc, values, isnull, replace);
+	}
+	PLLUA_CATCH_RETHROW();
+
+fail:
+	lua_settop(L, base);
+	return result;
+}
+
 /*
  * t:fromstring('str')  returns a datum object.
  *
@@ -5394,6 +5717,7 @@ static struct luaL_Reg typeinfo_methods[] = {
 	{ "element", pllua_typeinfo_element },
 	{ "dump", pllua_dump_typeinfo },
 	{ "name", pllua_typeinfo_name },
+	{ "slot", pllua_typeinfo_slot },
 	{ NULL, NULL }
 };
 
@@ -5444,6 +5768,9 @@ int pllua_open_pgtype(lua_State *L)
 	pllua_newmetatable(L, PLLUA_IDXLIST_OBJECT, idxlist_mt);
 	lua_pop(L, 1);
 
+	pllua_newmetatable(L, PLLUA_COLSLOT_OBJECT, colslot_mt);
+	lua_pop(L, 1);
+
 	pllua_newmetatable(L, PLLUA_TYPEINFO_OBJECT, typeinfo_mt);
 	lua_newtable(L);
 	luaL_setfuncs(L, typeinfo_methods, 0);
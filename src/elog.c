@@ -23,6 +23,13 @@ pllua_elog(lua_State *L,
 		   const char *e_table,
 		   const char *e_schema)
 {
+	/*
+	 * An error thrown from here must be catchable by an enclosing pcall, so
+	 * make sure its subtransaction exists.
+	 */
+	if (elevel >= ERROR && pllua_subxact_pending && !pllua_pending_error)
+		pllua_subxact_start_pending(L);
+
 	/*
 	 * Allow this even if an error is pending.
 	 */
@@ -561,6 +561,7 @@ pllua_initial_protected_call(pllua_interpreter *interp,
 {
 	sigjmp_buf *cur_catch_block PG_USED_FOR_ASSERTS_ONLY = PG_exception_stack;
 	pllua_activation_record save_activation = interp->cur_activation;
+	uint32		save_wait_event = pllua_current_wait_event();
 	int rc;
 
 	Assert(pllua_context == PLLUA_CONTEXT_PG);
@@ -571,6 +572,7 @@ pllua_initial_protected_call(pllua_interpreter *interp,
 #endif
 
 	interp->cur_activation = *arg;  /* copies content not pointer */
+	pllua_setup_call_limits(interp, &interp->cur_activation);
 
 	rc = pllua_cpcall(interp->L, func, &interp->cur_activation);
 
@@ -582,6 +584,9 @@ pllua_initial_protected_call(pllua_interpreter *interp,
 	*arg = interp->cur_activation;  /* copies content not pointer */
 	interp->cur_activation = save_activation;
 
+	/* in case a Lua error skipped the end of a pllua_phase */
+	pllua_phase_end(save_wait_event);
+
 	if (rc)
 		pllua_rethrow_from_lua(interp->L, rc);
 
@@ -786,13 +791,22 @@ int pllua_t_lxpcall (lua_State *L) {
  * that into the outer context.
  *
  * This is all aimed at preserving the following invariant: we can only run the
- * user's Lua code inside an error-free subtransaction.
+ * user's Lua code that interacts with pg inside an error-free subtransaction.
+ *
+ * Subtransactions are started lazily: pcall pushes a pending entry on the
+ * subxact stack, and the actual BeginInternalSubTransaction happens only when
+ * the protected code first enters pg context (see pllua_setcontext), at which
+ * point all pending entries are started, outermost first. So pcall around
+ * code that never touches the database costs nothing at the transaction
+ * level (no subxact, and hence no subxid). A pg error can only be caught by a
+ * pcall whose subxact was started; it passes through pending ones.
  */
 
 typedef struct pllua_subxact
 {
 	volatile struct pllua_subxact *prev;
 	bool				onstack;
+	bool				started;
     ResourceOwner		resowner;
     MemoryContext		mcontext;
 	ResourceOwner		own_resowner;
@@ -800,16 +814,89 @@ typedef struct pllua_subxact
 
 static volatile pllua_subxact *subxact_stack_top = NULL;
 
+/* true if the top of the subxact stack has not been started yet */
+bool pllua_subxact_pending = false;
+
+/*
+ * Start the given subxact and any pending ones below it. Pending entries are
+ * always at the top of the stack, so we stop at the first started one.
+ */
+static void
+pllua_subxact_begin(volatile pllua_subxact *xa, pllua_func_stats *stats)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	uint32		wait_event;
+
+	if (!xa || xa->started)
+		return;
+
+	pllua_subxact_begin(xa->prev, stats);
+
+	xa->resowner = CurrentResourceOwner;
+	wait_event = pllua_phase_begin(PLLUA_PHASE_SUBXACT);
+	PLLUA_PROBE(subxact__begin__start);
+	BeginInternalSubTransaction(NULL);
+	PLLUA_PROBE(subxact__begin__done);
+	pllua_phase_end(wait_event);
+	xa->started = true;
+	if (stats)
+		++stats->subxacts;
+	xa->own_resowner = CurrentResourceOwner;
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Called (in lua context) when about to enter pg context with pending
+ * subxacts on the stack.
+ */
+void
+pllua_subxact_start_pending(lua_State *L)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+
+	/* clear this first, since PLLUA_TRY would otherwise recurse here */
+	pllua_subxact_pending = false;
+
+	PLLUA_TRY();
+	{
+		pllua_subxact_begin(subxact_stack_top, interp->cur_activation.stats);
+	}
+	PLLUA_CATCH_RETHROW();
+}
+
+/*
+ * Pop a subxact that was never started.
+ */
+static void
+pllua_subxact_discard(void)
+{
+	volatile pllua_subxact *xa = subxact_stack_top;
+	Assert(xa->onstack && !xa->started);
+	xa->onstack = false;
+	subxact_stack_top = xa->prev;
+	pllua_subxact_pending = (xa->prev && !xa->prev->started);
+}
+
 static void
 pllua_subxact_abort(lua_State *L)
 {
 	PLLUA_TRY();
 	{
 		volatile pllua_subxact *xa = subxact_stack_top;
-		Assert(xa->onstack);
+
+		Assert(xa->onstack && xa->started);
 		xa->onstack = false;
 		subxact_stack_top = xa->prev;
+		/*
+		 * Whatever wait event is current belongs to the operation that
+		 * failed, so there's nothing worth restoring afterwards (the abort
+		 * clears it anyway).
+		 */
+		(void) pllua_phase_begin(PLLUA_PHASE_SUBXACT);
+		PLLUA_PROBE(subxact__abort__start);
 		RollbackAndReleaseCurrentSubTransaction();
+		PLLUA_PROBE(subxact__abort__done);
+		pllua_phase_end(0);
 		MemoryContextSwitchTo(xa->mcontext);
 		CurrentResourceOwner = xa->resowner;
 		pllua_pending_error = false;
@@ -868,9 +955,22 @@ pllua_intercept_error(lua_State *L)
 		 * error will recurse here unless we establish another pcall (which we
 		 * do below).
 		 *
-		 * Abort the subxact and pop it.
+		 * Abort the subxact and pop it. If it was never started, then there's
+		 * nothing to abort, but nor can we catch a pg error here; return it
+		 * unchanged without calling the handler, and the pcall wrapper will
+		 * rethrow it to an outer level that can.
 		 */
-		pllua_subxact_abort(L);
+		if (!subxact_stack_top->started)
+		{
+			pllua_subxact_discard();
+			if (pllua_pending_error)
+			{
+				lua_settop(L, 1);
+				return 1;
+			}
+		}
+		else
+			pllua_subxact_abort(L);
 
 		/*
 		 * The original pg error if any is now only of interest to the error
@@ -975,65 +1075,87 @@ pllua_t_pcall_guts(lua_State *L, bool is_xpcall)
 
 	ASSERT_LUA_CONTEXT;
 
-	pllua_setcontext(L, PLLUA_CONTEXT_PG);
-	PG_TRY();
+	/* push a pending subxact; it gets started on first entry to pg */
+	xa.resowner = CurrentResourceOwner;
+	xa.mcontext = oldcontext;
+	xa.onstack = true;
+	xa.started = false;
+	xa.prev = subxact_stack_top;
+	xa.own_resowner = NULL;
+	subxact_stack_top = &xa;
+	pllua_subxact_pending = true;
+
+	rc = pllua_pcall_nothrow(L,
+							 lua_gettop(L) - (is_xpcall ? 4 : 2),
+							 LUA_MULTRET,
+							 (is_xpcall ? 2 : 0));
+
+	if (!xa.onstack)
 	{
-		xa.resowner = CurrentResourceOwner;
-		xa.mcontext = oldcontext;
-		xa.onstack = false;
-		xa.prev = subxact_stack_top;
-		xa.own_resowner = NULL;
-
-		BeginInternalSubTransaction(NULL);
-
-		xa.onstack = true;
-		xa.own_resowner = CurrentResourceOwner;
-		subxact_stack_top = &xa;
-
-		rc = pllua_pcall_nothrow(L,
-								 lua_gettop(L) - (is_xpcall ? 4 : 2),
-								 LUA_MULTRET,
-								 (is_xpcall ? 2 : 0));
-
-		if (rc == LUA_OK)
+		/*
+		 * error handler must have intercepted and done the abort already.
+		 * But this implies that we need to check the registry for a
+		 * rethrow, rather than clearing it out.
+		 */
+		Assert(rc != LUA_OK);
+		rethrow = true;
+	}
+	else if (!xa.started)
+	{
+		/*
+		 * The protected code never entered pg, so there is nothing to commit
+		 * or abort. If we have a pg error anyway (which can happen only if it
+		 * was thrown from somewhere that doesn't start subxacts, such as an
+		 * interrupt check, or if starting the subxact failed), we can't catch
+		 * it; pass it on to an outer pcall that can.
+		 */
+		Assert(subxact_stack_top == &xa);
+		pllua_subxact_discard();
+		if (rc != LUA_OK && pllua_pending_error)
+			rethrow = true;
+	}
+	else
+	{
+		pllua_setcontext(L, PLLUA_CONTEXT_PG);
+		PG_TRY();
 		{
-			/* Commit the inner transaction, return to outer xact context */
-			ReleaseCurrentSubTransaction();
-			MemoryContextSwitchTo(oldcontext);
-			CurrentResourceOwner = xa.resowner;
-
-			Assert(subxact_stack_top == &xa);
-			subxact_stack_top = xa.prev;
+			if (rc == LUA_OK)
+			{
+				uint32		wait_event;
+
+				/* Commit the inner transaction, return to outer xact context */
+				wait_event = pllua_phase_begin(PLLUA_PHASE_SUBXACT);
+				PLLUA_PROBE(subxact__commit__start);
+				ReleaseCurrentSubTransaction();
+				PLLUA_PROBE(subxact__commit__done);
+				pllua_phase_end(wait_event);
+				MemoryContextSwitchTo(oldcontext);
+				CurrentResourceOwner = xa.resowner;
+
+				Assert(subxact_stack_top == &xa);
+				subxact_stack_top = xa.prev;
+			}
+			else
+				pllua_subxact_abort(L);
 		}
-		else if (xa.onstack)
-			pllua_subxact_abort(L);
-		else
+		PG_CATCH();
 		{
+			pllua_setcontext(NULL, PLLUA_CONTEXT_LUA);
+			/* absorb the error and get out of pg's error handling */
+			pllua_absorb_pg_error(L);
+			if (xa.onstack)
+				pllua_subxact_abort(L);
 			/*
-			 * error handler must have intercepted and done the abort already.
-			 * But this implies that we need to check the registry for a
-			 * rethrow, rather than clearing it out.
+			 * Can only get here if release of the subxact threw an error. (We
+			 * assume that release of a subxact can only result in aborting it
+			 * instead.) Treat this as an error within the parent context.
 			 */
-			rethrow = true;
+			MemoryContextSwitchTo(oldcontext);
+			lua_error(L);
 		}
-	}
-	PG_CATCH();
-	{
+		PG_END_TRY();
 		pllua_setcontext(NULL, PLLUA_CONTEXT_LUA);
-		/* absorb the error and get out of pg's error handling */
-		pllua_absorb_pg_error(L);
-		if (xa.onstack)
-			pllua_subxact_abort(L);
-		/*
-		 * Can only get here if begin or release of the subxact threw an error.
-		 * (We assume that release of a subxact can only result in aborting it
-		 * instead.) Treat this as an error within the parent context.
-		 */
-		MemoryContextSwitchTo(oldcontext);
-		lua_error(L);
 	}
-	PG_END_TRY();
-	pllua_setcontext(NULL, PLLUA_CONTEXT_LUA);
 
 	if (rc == LUA_OK)
 	{
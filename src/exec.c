@@ -8,24 +8,68 @@
 #include "commands/event_trigger.h"
 #include "utils/datum.h"
 
+/*
+ * Execution statistics (see pllua_get_func_stats). "mark" notes the current
+ * time; "accum" charges the time since the last mark to the given field of
+ * the stats entry, and marks again. Both do nothing unless stats are being
+ * collected for this call.
+ */
+#define pllua_stats_mark(act_, t_)										\
+	do { if ((act_)->stats) INSTR_TIME_SET_CURRENT(t_); } while (0)
+
+#define pllua_stats_accum(act_, t_, field_)							\
+	do { if ((act_)->stats) {											\
+			instr_time now_;											\
+			INSTR_TIME_SET_CURRENT(now_);								\
+			INSTR_TIME_ACCUM_DIFF((act_)->stats->field_, now_, t_);	\
+			(t_) = now_; } } while (0)
+
 static void
 pllua_common_lua_init(lua_State *L, FunctionCallInfo fcinfo)
 {
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+
 	Assert(pllua_context == PLLUA_CONTEXT_LUA);
 	luaL_checkstack(L, 40, NULL);
+
+	interp->cur_activation.alloc_start = interp->alloc_bytes;
 }
 
 static void
 pllua_common_lua_exit(lua_State *L)
 {
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+	pllua_activation_record *act = &interp->cur_activation;
+	instr_time	t;
+
 	lua_settop(L, 0);
 
-	if (pllua_track_gc_debt)
+	pllua_stats_mark(act, t);
+
+	/*
+	 * If deferred, the debt is paid off at commit; see pllua_xact_callback.
+	 * But debt that a commit had to skip is paid here, in full.
+	 */
+	if (pllua_track_gc_debt && interp->gc_debt_carried)
+	{
+		unsigned long gc_debt = interp->gc_debt;
+		interp->gc_debt = 0;
+		interp->gc_debt_carried = false;
+		pllua_run_extra_gc(L, gc_debt, 0);
+	}
+	else if (pllua_track_gc_debt && !pllua_gc_deferred)
 	{
-		pllua_interpreter *interp = pllua_getinterpreter(L);
 		unsigned long gc_debt = interp->gc_debt;
 		interp->gc_debt = 0;
-		pllua_run_extra_gc(L, gc_debt);
+		interp->gc_debt = pllua_run_extra_gc(L, gc_debt, pllua_gc_step_limit);
+	}
+
+	pllua_free_pending_datums(L);
+
+	if (act->stats)
+	{
+		pllua_stats_accum(act, t, gc_time);
+		act->stats->alloc_bytes += interp->alloc_bytes - act->alloc_start;
 	}
 }
 
@@ -333,13 +377,18 @@ pllua_resume_function(lua_State *L)
 	lua_State  *thr = fact->thread;
 	int			rc;
 	int			nret;
+	instr_time	t;
 
 	Assert(thr != NULL);
 	Assert(lua_gettop(L) == 1);
 
+	pllua_common_lua_init(L, fcinfo);
+
+	pllua_stats_mark(act, t);
 	fact->onstack = true;
 	rc = lua_resume(thr, L, 0, &nret);
 	fact->onstack = false;
+	pllua_stats_accum(act, t, exec_time);
 
 	if (rc == LUA_OK)
 	{
@@ -370,6 +419,7 @@ pllua_resume_function(lua_State *L)
 	act->retval = pllua_return_result(L, nret,
 									  fact,
 									  &fcinfo->isnull);
+	pllua_stats_accum(act, t, result_time);
 
 	pllua_common_lua_exit(L);
 
@@ -390,11 +440,15 @@ pllua_call_function(lua_State *L)
 	int			nargs;
 	int			nret;
 	int			rc;
+	instr_time	t;
 
 	pllua_common_lua_init(L, fcinfo);
 
+	pllua_stats_mark(act, t);
+
 	/* pushes the activation on the stack */
 	fact = pllua_validate_and_push(L, fcinfo, act->trusted);
+	pllua_stats_accum(act, t, compile_time);
 
 	/* stack mark for result processing */
 	nstack = lua_gettop(L);
@@ -407,6 +461,7 @@ pllua_call_function(lua_State *L)
 	Assert(lua_gettop(L) == nstack + 1);
 
 	nargs = pllua_push_args(L, fcinfo, fact);
+	pllua_stats_accum(act, t, args_time);
 
 	if (fact->retset)
 	{
@@ -421,6 +476,7 @@ pllua_call_function(lua_State *L)
 		fact->onstack = true;
 		rc = lua_resume(thr, L, nargs, &nret);
 		fact->onstack = false;
+		pllua_stats_accum(act, t, exec_time);
 
 		/*
 		 * If we got LUA_OK, the function returned without yielding. If it
@@ -470,6 +526,7 @@ pllua_call_function(lua_State *L)
 	else
 	{
 		lua_call(L, nargs, LUA_MULTRET);
+		pllua_stats_accum(act, t, exec_time);
 		luaL_checkstack(L, 10, NULL);
 	}
 
@@ -481,6 +538,7 @@ pllua_call_function(lua_State *L)
 	act->retval = pllua_return_result(L, lua_gettop(L) - nstack,
 									  fact,
 									  &fcinfo->isnull);
+	pllua_stats_accum(act, t, result_time);
 
 	pllua_common_lua_exit(L);
 
@@ -496,16 +554,21 @@ pllua_call_trigger(lua_State *L)
 	pllua_activation_record *act = lua_touserdata(L, 1);
 	FunctionCallInfo fcinfo = act->fcinfo;
 	TriggerData *td = (TriggerData *) fcinfo->context;
+	pllua_func_activation *fact;
 	int			nstack;
 	int			nargs;
+	instr_time	t;
 
 	pllua_common_lua_init(L, fcinfo);
 
+	pllua_stats_mark(act, t);
+
 	/* push a trigger object on the stack */
 	pllua_trigger_begin(L, td);
 
 	/* pushes the activation on the stack */
-	pllua_validate_and_push(L, fcinfo, act->trusted);
+	fact = pllua_validate_and_push(L, fcinfo, act->trusted);
+	pllua_stats_accum(act, t, compile_time);
 
 	/* stack mark for result processing */
 	nstack = lua_gettop(L);
@@ -519,16 +582,31 @@ pllua_call_trigger(lua_State *L)
 	 * plus a variable number of string args from tg_args. These don't
 	 * correspond in any way to the arguments declared in the funcinfo (which
 	 * will specify that there are no args).
+	 *
+	 * Fetching old and new means copying the trigger tuples into row datums,
+	 * so skip that if the function body never mentions them; it can still
+	 * get at them via the trigger object, which does the copy on demand.
 	 */
 	lua_pushvalue(L, 2);
-	lua_getfield(L, -1, "old");
-	lua_getfield(L, -2, "new");
+	if (fact->func_info->trigger_rows_used)
+	{
+		lua_getfield(L, -1, "old");
+		lua_getfield(L, -2, "new");
+	}
+	else
+	{
+		lua_pushnil(L);
+		lua_pushnil(L);
+	}
 	nargs = 3 + pllua_push_trigger_args(L, td);
+	pllua_stats_accum(act, t, args_time);
 
 	lua_call(L, nargs, LUA_MULTRET);
+	pllua_stats_accum(act, t, exec_time);
 	luaL_checkstack(L, 10, NULL);
 
 	act->retval = pllua_return_trigger_result(L, lua_gettop(L) - nstack, 2);
+	pllua_stats_accum(act, t, result_time);
 
 	/* mark the trigger object dead */
 	pllua_trigger_end(L, 2);
@@ -549,14 +627,18 @@ pllua_call_event_trigger(lua_State *L)
 	pllua_activation_record *act = lua_touserdata(L, 1);
 	FunctionCallInfo fcinfo = act->fcinfo;
 	EventTriggerData *etd = (EventTriggerData *) fcinfo->context;
+	instr_time	t;
 
 	pllua_common_lua_init(L, fcinfo);
 
+	pllua_stats_mark(act, t);
+
 	/* push a trigger object on the stack (index 2) */
 	pllua_evtrigger_begin(L, etd);
 
 	/* pushes the activation on the stack */
 	pllua_validate_and_push(L, fcinfo, act->trusted);
+	pllua_stats_accum(act, t, compile_time);
 
 	/* get the function object from the activation and push that */
 	pllua_activation_getfunc(L);
@@ -569,6 +651,7 @@ pllua_call_event_trigger(lua_State *L)
 	 */
 	lua_pushvalue(L, 2);
 	lua_call(L, 1, 0);
+	pllua_stats_accum(act, t, exec_time);
 
 	act->retval = PointerGetDatum(NULL);
 
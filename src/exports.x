@@ -8,6 +8,12 @@
     plluau_validator;	    pg_finfo_plluau_validator;
     plluau_call_handler;    pg_finfo_plluau_call_handler;
     plluau_inline_handler;  pg_finfo_plluau_inline_handler;
+    pllua_profile_start;    pg_finfo_pllua_profile_start;
+    pllua_profile_stop;	    pg_finfo_pllua_profile_stop;
+    pllua_profile_results;  pg_finfo_pllua_profile_results;
+    pllua_function_stats;   pg_finfo_pllua_function_stats;
+    pllua_function_stats_reset; pg_finfo_pllua_function_stats_reset;
+    pllua_interpreters;     pg_finfo_pllua_interpreters;
     pllua_rethrow_from_pg;
     pllua_pcall_nothrow;
     pllua_cpcall;
@@ -24,6 +24,7 @@ char PLLUA_LANG_OID[] = "language oid";
 char PLLUA_FUNCTION_OBJECT[] = "function object";
 char PLLUA_ERROR_OBJECT[] = "error object";
 char PLLUA_IDXLIST_OBJECT[] = "idxlist object";
+char PLLUA_COLSLOT_OBJECT[] = "column slot object";
 char PLLUA_ACTIVATION_OBJECT[] = "activation object";
 char PLLUA_MCONTEXT_OBJECT[] = "memory context object";
 char PLLUA_TYPEINFO_OBJECT[] = "typeinfo object";
@@ -8,11 +8,19 @@
 #include "pllua.h"
 
 #include "access/htup_details.h"
+#include "access/xact.h"
 #include "catalog/pg_proc.h"
 #include "nodes/pg_list.h"
 #include "storage/ipc.h"
 #include "utils/inval.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 140000
+#include "utils/wait_event.h"
+#elif PG_VERSION_NUM >= 100000
+#include "pgstat.h"
+#include "storage/proc.h"
+#endif
 
 #include <time.h>
 
@@ -20,6 +28,9 @@ PGDLLEXPORT void _PG_init(void);
 
 #define PLLUA_ERROR_CONTEXT_SIZES 8*1024, 8*1024, 8*1024
 
+/* how many Lua instructions between count hook calls, at most */
+#define PLLUA_HOOK_COUNT 100000
+
 static bool simulate_memory_failure = false;
 
 static HTAB *pllua_interp_hash = NULL;
@@ -31,12 +42,21 @@ static char *pllua_on_trusted_init = NULL;
 static char *pllua_on_untrusted_init = NULL;
 static char *pllua_on_common_init = NULL;
 static bool pllua_do_check_for_interrupts = true;
+static int pllua_max_instructions = 0;
+static int pllua_max_call_time = 0;
 /* trusted.c also needs this */
 bool pllua_do_install_globals = true;
 static int pllua_num_held_interpreters = 1;
 static char *pllua_reload_ident = NULL;
 static double pllua_gc_threshold = 0;
 static double pllua_gc_multiplier = 0;
+static bool pllua_gc_generational = false;
+/* exec.c also needs these */
+bool pllua_gc_deferred = false;
+int pllua_gc_step_limit = 0;
+/* pllua.c and profile.c also need this */
+bool pllua_track_function_stats = false;
+int pllua_shared_memory_size = 0;
 
 static const char *pllua_pg_version_str = NULL;
 static const char *pllua_pg_version_num = NULL;
@@ -50,8 +70,14 @@ static void pllua_newstate_phase2(pllua_interpreter_hashent *interp_desc,
 								  Oid user_id,
 								  pllua_activation_record *act);
 static void pllua_fini(int code, Datum arg);
+static void pllua_xact_callback(XactEvent event, void *arg);
+static void pllua_set_gc_mode(lua_State *L);
 static void pllua_warnfunction(void *p, const char *msg, int tocont);
 static void *pllua_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+static void pllua_init_wait_events(void);
+
+static uint32 pllua_wait_events[PLLUA_NUM_PHASES];
+static bool pllua_wait_events_ready = false;
 
 /*
  * pllua_getstate
@@ -63,10 +89,15 @@ pllua_getstate(bool trusted, pllua_activation_record *act)
 {
 	Oid	user_id = trusted ? GetUserId() : InvalidOid;
 	pllua_interpreter_hashent *interp_desc;
+	pllua_interpreter *interp;
+	uint32		wait_event;
 	bool found;
 
 	Assert(pllua_context == PLLUA_CONTEXT_PG);
 
+	if (!pllua_wait_events_ready)
+		pllua_init_wait_events();
+
 	interp_desc = hash_search(pllua_interp_hash, &user_id,
 							  HASH_ENTER,
 							  &found);
@@ -86,6 +117,13 @@ pllua_getstate(bool trusted, pllua_activation_record *act)
 				pllua_rethrow_from_lua(interp->L, rc);  /* unlikely, but be safe */
 		}
 
+		if (interp->gc_generational != pllua_gc_generational)
+		{
+			int rc = pllua_cpcall(interp->L, pllua_switch_gc_mode, interp);
+			if (rc)
+				pllua_rethrow_from_lua(interp->L, rc);
+		}
+
 		return interp;
 	}
 
@@ -100,21 +138,102 @@ pllua_getstate(bool trusted, pllua_activation_record *act)
 	 * this can throw a pg error, but is required to ensure the interpreter is
 	 * removed from interp_desc and freed first if it does.
 	 */
+	wait_event = pllua_phase_begin(PLLUA_PHASE_NEWSTATE);
+	PLLUA_PROBE1(newstate__start, user_id);
+
 	if (held_states != NIL)
 	{
-		pllua_interpreter *interp = linitial(held_states);
+		interp = linitial(held_states);
 		held_states = list_delete_first(held_states);
-		pllua_newstate_phase2(interp_desc, interp, trusted, user_id, act);
-		return interp;
 	}
 	else
 	{
-		pllua_interpreter *interp = pllua_newstate_phase1(pllua_reload_ident);
+		interp = pllua_newstate_phase1(pllua_reload_ident);
 		if (!interp)
 			elog(ERROR, "PL/Lua: interpreter creation failed");
-		pllua_newstate_phase2(interp_desc, interp, trusted, user_id, act);
-		return interp;
 	}
+	pllua_newstate_phase2(interp_desc, interp, trusted, user_id, act);
+
+	PLLUA_PROBE1(newstate__done, user_id);
+	pllua_phase_end(wait_event);
+
+	return interp;
+}
+
+/*
+ * Wait events for the phases in pllua_phase. These don't nest in PG, so we
+ * put back whatever was there before when a phase ends; also a PG error
+ * clears the wait event, and pllua_initial_protected_call restores it on
+ * exit, so a Lua error can't leave one of ours behind either.
+ *
+ * On PG 17+ each phase gets its own named event; otherwise they all show as
+ * the generic "Extension" event. Before PG 10 none of this does anything.
+ */
+static void
+pllua_init_wait_events(void)
+{
+#if PG_VERSION_NUM >= 170000
+	static const char *const names[PLLUA_NUM_PHASES] = {
+		"PlluaNewState",
+		"PlluaCompile",
+		"PlluaGC",
+		"PlluaSubxact",
+		"PlluaSPI"
+	};
+#endif
+#if PG_VERSION_NUM >= 100000
+	int			i;
+
+	for (i = 0; i < PLLUA_NUM_PHASES; ++i)
+	{
+#if PG_VERSION_NUM >= 170000
+		if (IsUnderPostmaster)
+			pllua_wait_events[i] = WaitEventExtensionNew(names[i]);
+		else
+#endif
+			pllua_wait_events[i] = PG_WAIT_EXTENSION;
+	}
+#endif
+	pllua_wait_events_ready = IsUnderPostmaster;
+}
+
+uint32
+pllua_current_wait_event(void)
+{
+#if PG_VERSION_NUM >= 140000
+	return *my_wait_event_info;
+#elif PG_VERSION_NUM >= 100000
+	return MyProc ? MyProc->wait_event_info : 0;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Can be called in either context; doesn't throw.
+ */
+uint32
+pllua_phase_begin(pllua_phase phase)
+{
+#if PG_VERSION_NUM >= 100000
+	uint32		prev = pllua_current_wait_event();
+
+	pgstat_report_wait_start(pllua_wait_events[phase]);
+	return prev;
+#else
+	return 0;
+#endif
+}
+
+void
+pllua_phase_end(uint32 prev)
+{
+#if PG_VERSION_NUM >= 100000
+	if (prev)
+		pgstat_report_wait_start(prev);
+	else
+		pgstat_report_wait_end();
+#endif
 }
 
 static void
@@ -230,17 +349,31 @@ pllua_assign_gc_multiplier(double newval, void *extra)
 		pllua_track_gc_debt = false;
 }
 
-void
-pllua_run_extra_gc(lua_State *L, unsigned long gc_debt)
+/*
+ * Do the extra GC work to pay for gc_debt bytes of non-Lua memory.
+ *
+ * If step_limit is nonzero, the step size is capped to that, and the part
+ * of the debt that this didn't pay for is returned so that the caller can
+ * carry it forward (it's paid off at commit time at the latest). Otherwise
+ * returns 0.
+ */
+unsigned long
+pllua_run_extra_gc(lua_State *L, unsigned long gc_debt, int step_limit)
 {
+	unsigned long remaining = 0;
+	uint32		wait_event;
 	double val;
 
 	if (pllua_gc_multiplier == 0.0)
-		return;
+		return 0;
 
 	val = gc_debt / 1024;
 	if (val < pllua_gc_threshold)
-		return;
+		return 0;
+
+	wait_event = pllua_phase_begin(PLLUA_PHASE_GC);
+	PLLUA_PROBE1(gc__start, gc_debt);
+
 	if (pllua_gc_multiplier > 999999.0)
 	{
 		pllua_debug(L, "pllua_run_extra_gc: full collect");
@@ -251,15 +384,134 @@ pllua_run_extra_gc(lua_State *L, unsigned long gc_debt)
 		int ival;
 
 		val *= pllua_gc_multiplier;
-		if (val >= (double) INT_MAX)
-			ival = INT_MAX;
+		if (step_limit > 0 && val > (double) step_limit)
+		{
+			pllua_debug(L, "pllua_run_extra_gc: step %d (limited)", step_limit);
+			lua_gc(L, LUA_GCSTEP, step_limit);
+			remaining = (unsigned long) (gc_debt * (1.0 - step_limit / val));
+		}
 		else
-			ival = (int) val;
-		pllua_debug(L, "pllua_run_extra_gc: step %d", ival);
-		lua_gc(L, LUA_GCSTEP, ival);
+		{
+			if (val >= (double) INT_MAX)
+				ival = INT_MAX;
+			else
+				ival = (int) val;
+			pllua_debug(L, "pllua_run_extra_gc: step %d", ival);
+			lua_gc(L, LUA_GCSTEP, ival);
+		}
+	}
+
+	PLLUA_PROBE1(gc__done, remaining);
+	pllua_phase_end(wait_event);
+
+	return remaining;
+}
+
+/*
+ * Pay off all of an interpreter's outstanding GC debt.
+ */
+int
+pllua_run_deferred_gc(lua_State *L)
+{
+	pllua_activation_record *act = lua_touserdata(L, 1);
+	pllua_interpreter *interp = act->interp;
+	unsigned long gc_debt = interp->gc_debt;
+
+	interp->gc_debt = 0;
+	interp->gc_debt_carried = false;
+	pllua_run_extra_gc(L, gc_debt, 0);
+	pllua_free_pending_datums(L);
+	return 0;
+}
+
+/*
+ * At commit, do whatever GC work was deferred (by pllua.extra_gc_deferred or
+ * pllua.extra_gc_step_limit) during the transaction. We do this at pre-commit
+ * rather than commit, because finalizers can do database work and it's still
+ * safe to throw errors here. Interpreters that are in use (i.e. a procedure
+ * is doing spi.commit()) are left alone; their debt carries over.
+ *
+ * Since finalizers can run user code, a trusted interpreter is only collected
+ * here if it belongs to the current user, i.e. the one that would be used for
+ * a call made right now; others are flagged to pay their debt at the end of
+ * their own next call (see pllua_common_lua_exit). The collection is done
+ * under an activation of its own, just as for a call.
+ */
+static void
+pllua_xact_callback(XactEvent event, void *arg)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pllua_interpreter_hashent *interp_desc;
+
+	if (event != XACT_EVENT_PRE_COMMIT
+		|| !pllua_track_gc_debt
+		|| pllua_ending
+		|| !pllua_interp_hash)
+		return;
+
+	hash_seq_init(&hash_seq, pllua_interp_hash);
+	while ((interp_desc = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pllua_interpreter *interp = interp_desc->interp;
+		pllua_activation_record act;
+
+		if (!interp
+			|| !interp->L
+			|| interp->gc_debt == 0
+			|| interp->cur_activation.interp != NULL)
+			continue;
+
+		if (interp_desc->trusted && interp->user_id != GetUserId())
+		{
+			interp->gc_debt_carried = true;
+			continue;
+		}
+
+		memset(&act, 0, sizeof(act));
+		act.atomic = true;
+		act.trusted = interp_desc->trusted;
+		act.active_error = LUA_REFNIL;
+		act.interp = interp;
+		act.err_text = "deferred garbage collection";
+
+		PG_TRY();
+		{
+			pllua_initial_protected_call(interp, pllua_run_deferred_gc, &act);
+		}
+		PG_CATCH();
+		{
+			hash_seq_term(&hash_seq);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
 	}
 }
 
+/*
+ * Set the collector mode according to pllua.gc_generational. This only
+ * means anything in Lua 5.4; elsewhere the flag is just recorded.
+ */
+static void
+pllua_set_gc_mode(lua_State *L)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+
+#if LUA_VERSION_NUM >= 504
+	if (pllua_gc_generational)
+		lua_gc(L, LUA_GCGEN, 0, 0);
+	else
+		lua_gc(L, LUA_GCINC, 0, 0, 0);
+#endif
+	interp->gc_generational = pllua_gc_generational;
+}
+
+int
+pllua_switch_gc_mode(lua_State *L)
+{
+	pllua_set_gc_mode(L);
+	return 0;
+}
+
 static const char *
 pllua_get_config_value(const char *name)
 {
@@ -336,6 +588,31 @@ void _PG_init(void)
 							 true,
 							 PGC_SUSET, 0,
 							 NULL, NULL, NULL);
+	DefineCustomIntVariable("pllua.max_instructions_per_call",
+							gettext_noop("Maximum number of Lua instructions to execute in one function call."),
+							gettext_noop("Zero means no limit."),
+							&pllua_max_instructions,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET, 0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("pllua.max_time_per_call",
+							gettext_noop("Maximum elapsed time for one function call."),
+							gettext_noop("Zero means no limit."),
+							&pllua_max_call_time,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET, GUC_UNIT_MS,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("pllua.track_function_stats",
+							 gettext_noop("Collects per-function execution statistics."),
+							 NULL,
+							 &pllua_track_function_stats,
+							 false,
+							 PGC_SUSET, 0,
+							 NULL, NULL, NULL);
 	DefineCustomIntVariable("pllua.prebuilt_interpreters",
 							gettext_noop("Number of interpreters to prebuild if preloaded"),
 							NULL,
@@ -345,6 +622,15 @@ void _PG_init(void)
 							10,
 							PGC_SIGHUP, 0,
 							NULL, NULL, NULL);
+	DefineCustomIntVariable("pllua.shared_memory_size",
+							gettext_noop("Size of the shared memory area for pllua.shared."),
+							gettext_noop("Zero disables pllua.shared. Only effective if preloaded."),
+							&pllua_shared_memory_size,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER, GUC_UNIT_KB,
+							NULL, NULL, NULL);
 	DefineCustomStringVariable("pllua.interpreter_reload_ident",
 							   gettext_noop("Altering this id reloads any held interpreters"),
 							   NULL,
@@ -376,9 +662,34 @@ void _PG_init(void)
 							 (double)(LONG_MAX / 1024),
 							 PGC_USERSET, 0,
 							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("pllua.extra_gc_deferred",
+							 gettext_noop("Defer additional GC calls to transaction commit"),
+							 NULL,
+							 &pllua_gc_deferred,
+							 false,
+							 PGC_USERSET, 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("pllua.extra_gc_step_limit",
+							gettext_noop("Maximum size of an additional GC step at the end of a call"),
+							gettext_noop("Zero means no limit; any remaining work is deferred."),
+							&pllua_gc_step_limit,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET, 0,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("pllua.gc_generational",
+							 gettext_noop("Use the generational garbage collector (Lua 5.4 only)"),
+							 NULL,
+							 &pllua_gc_generational,
+							 false,
+							 PGC_USERSET, 0,
+							 NULL, NULL, NULL);
 
 	EmitWarningsOnPlaceholders("pllua");
 
+	pllua_shared_init();
+
 	/*
 	 * Create hash table for interpreters.
 	 */
@@ -390,6 +701,8 @@ void _PG_init(void)
 									&hash_ctl,
 									HASH_ELEM | HASH_BLOBS);
 
+	RegisterXactCallback(pllua_xact_callback, NULL);
+
 	if (!IsUnderPostmaster)
 		pllua_create_held_states(pllua_reload_ident);
 
@@ -450,6 +763,15 @@ pllua_fini(int code, Datum arg)
 	elog(DEBUG2, "pllua_fini: done");
 }
 
+/*
+ * For pllua_interpreters(), which reports on the contents of the hash.
+ */
+HTAB *
+pllua_get_interp_hash(void)
+{
+	return pllua_interp_hash;
+}
+
 /*
  * Broadcast an invalidation to all interpreters (if arg==0) or the specified
  * interpreter.
@@ -523,10 +845,9 @@ pllua_syscache_cast_callback(Datum arg, int cacheid, uint32 hashvalue)
 static void *
 pllua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
 {
+	pllua_interpreter *interp = ud;
 	void	   *nptr;
 
-	(void)ud;  /* not used */
-
 	if (nsize == 0)
 	{
 		free(ptr);							/* free(NULL) is explicitly safe */
@@ -539,6 +860,12 @@ pllua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
 	else
 		nptr = realloc(ptr, nsize);
 
+	/* for execution statistics; osize is not a size if ptr is NULL */
+	if (!ptr)
+		interp->alloc_bytes += nsize;
+	else if (nsize > osize)
+		interp->alloc_bytes += nsize - osize;
+
 	if (ptr && nsize < osize)
 	{
 		if (!nptr)
@@ -560,6 +887,12 @@ static void *
 pllua_alloc_shim(void *ud, void *ptr, size_t osize, size_t nsize)
 {
 	pllua_interpreter *interp = ud;
+
+	if (!ptr)
+		interp->alloc_bytes += nsize;
+	else if (nsize > osize)
+		interp->alloc_bytes += nsize - osize;
+
 	return interp->allocf(interp->alloc_ud, ptr, osize, nsize);
 }
 
@@ -608,12 +941,92 @@ pllua_warnfunction(void *p, const char *msg, int tocont)
 }
 
 /*
- * Hook function to check for interrupts. We have lua call this for every
- * function return or set number of opcodes executed.
+ * Enforce the per-call resource limits; called from the count hook.
+ *
+ * The errors are ordinary catchable errors, but catching one doesn't reset
+ * the call's budget, so code that does so will just get the error again on
+ * the next hook call.
+ */
+static void
+pllua_check_call_limits(lua_State *L)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+	pllua_activation_record *act = &interp->cur_activation;
+	bool		over_instrs = false;
+	bool		over_time = false;
+
+	act->instr_count += lua_gethookcount(L);
+
+	if (pllua_max_instructions > 0
+		&& act->instr_count > (uint64) pllua_max_instructions)
+		over_instrs = true;
+	else if (pllua_max_call_time > 0
+			 && act->start_time != 0
+			 && TimestampDifferenceExceeds(act->start_time,
+										   GetCurrentTimestamp(),
+										   pllua_max_call_time))
+		over_time = true;
+	else
+		return;
+
+	/*
+	 * We're usually in pure Lua code here, so an enclosing pcall may not have
+	 * started its subxact yet; it must have one to be able to catch this.
+	 */
+	if (pllua_subxact_pending && !pllua_pending_error)
+		pllua_subxact_start_pending(L);
+
+	PLLUA_TRY_ERROK();
+	{
+		if (over_instrs)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("pllua: function call exceeded pllua.max_instructions_per_call (%d)",
+							pllua_max_instructions)));
+		else if (over_time)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("pllua: function call exceeded pllua.max_time_per_call (%dms)",
+							pllua_max_call_time)));
+	}
+	PLLUA_CATCH_RETHROW();
+}
+
+/*
+ * Hook function to check for interrupts. We have lua call this every set
+ * number of opcodes executed. (There's no return hook: any Lua code that runs
+ * for long enough to matter executes instructions, so the count hook already
+ * bounds the cancel latency, and a return hook would cost a dispatch on every
+ * function return.)
+ *
+ * Since this runs so often, test for a pending interrupt ourselves before
+ * paying for the setjmp needed to call CHECK_FOR_INTERRUPTS safely; the
+ * flag test is all that CHECK_FOR_INTERRUPTS would do anyway in the common
+ * case. (On Windows before the pending-condition macro existed, the check
+ * also has to dispatch queued signals, so don't try and short-cut it there.)
  */
 static void
 pllua_hook(lua_State *L, lua_Debug *ar)
 {
+	if (ar->event == LUA_HOOKCOUNT)
+	{
+		if (pllua_profiling)
+			pllua_profile_hook(L);
+		if (pllua_max_instructions > 0 || pllua_max_call_time > 0)
+			pllua_check_call_limits(L);
+	}
+
+	if (!pllua_do_check_for_interrupts)
+		return;
+
+#if defined(INTERRUPTS_PENDING_CONDITION)
+	if (!INTERRUPTS_PENDING_CONDITION())
+		return;
+#elif !defined(WIN32)
+	if (!InterruptPending)
+		return;
+#endif
+
 	/*
 	 * Allow this even if an error is pending.
 	 */
@@ -624,6 +1037,47 @@ pllua_hook(lua_State *L, lua_Debug *ar)
 	PLLUA_CATCH_RETHROW();
 }
 
+/*
+ * Start the resource-limit budget for a new activation. Every entry from PG
+ * gets its own budget, including recursive ones (the outer call's count is
+ * restored when the inner one returns, but the outer call's elapsed time
+ * includes the inner call).
+ *
+ * While a limit is in force, or the profiler is running, the count hook is
+ * needed even if interrupt checks are disabled, and it has to run often enough
+ * to honour a small instruction limit or sampling interval. Coroutines
+ * inherit the hook settings in force when they are created.
+ */
+void
+pllua_setup_call_limits(pllua_interpreter *interp, pllua_activation_record *act)
+{
+	lua_State  *L = interp->L;
+	int			mask = pllua_do_check_for_interrupts ? LUA_MASKCOUNT : 0;
+	int			count = PLLUA_HOOK_COUNT;
+
+	act->instr_count = 0;
+	act->start_time = 0;
+
+	if (pllua_max_instructions > 0)
+	{
+		mask |= LUA_MASKCOUNT;
+		count = Min(count, pllua_max_instructions);
+	}
+	if (pllua_max_call_time > 0)
+	{
+		mask |= LUA_MASKCOUNT;
+		act->start_time = GetCurrentTimestamp();
+	}
+	if (pllua_profiling)
+	{
+		mask |= LUA_MASKCOUNT;
+		count = Min(count, pllua_profile_interval);
+	}
+
+	if (lua_gethookmask(L) != mask || lua_gethookcount(L) != count)
+		lua_sethook(L, pllua_hook, mask, count);
+}
+
 /*
  * Simple bare-bones execution of a single string.
  */
@@ -706,6 +1160,22 @@ static void pllua_wrap_stack_checks(lua_State *L)
 	lua_pop(L, 2);
 }
 
+/*
+ * Wrapper for collectgarbage(), which is in upvalue 1. Datums finalized by
+ * the collection are only queued for freeing (see pllua_datum_gc); someone
+ * calling this explicitly wants the memory back now, so free them.
+ */
+static int
+pllua_collectgarbage(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, nargs, LUA_MULTRET);
+	pllua_free_pending_datums(L);
+	return lua_gettop(L);
+}
+
 /*
  * Lua-environment part of interpreter setup.
  *
@@ -750,6 +1220,10 @@ pllua_init_state_phase1(lua_State *L)
 	 */
 	pllua_wrap_stack_checks(L);
 
+	lua_getglobal(L, "collectgarbage");
+	lua_pushcclosure(L, pllua_collectgarbage, 1);
+	lua_setglobal(L, "collectgarbage");
+
 	/*
 	 * Initialize our error handling, which replaces many base functions
 	 * (pcall, xpcall, etc.). Must be done after openlibs but before anything
@@ -834,6 +1308,8 @@ pllua_init_state_phase2(lua_State *L)
 
 	luaL_requiref(L, "pllua.time", pllua_open_time, 0);
 
+	luaL_requiref(L, "pllua.shared", pllua_open_shared, 0);
+
 	/*
 	 * complete the initialization of the trusted-mode sandbox.
 	 * We do this in untrusted interps too, but for those, we don't
@@ -867,9 +1343,11 @@ pllua_init_state_phase2(lua_State *L)
 	lua_setfield(L, -2, "pllua.compat");
 	lua_settop(L, 0);
 
+	pllua_set_gc_mode(L);
+
 	/* enable interrupt checks */
 	if (pllua_do_check_for_interrupts)
-		lua_sethook(L, pllua_hook, LUA_MASKRET | LUA_MASKCOUNT, 100000);
+		lua_sethook(L, pllua_hook, LUA_MASKCOUNT, PLLUA_HOOK_COUNT);
 
 	/* don't run user code yet */
 	return 0;
@@ -941,6 +1419,10 @@ pllua_newstate_phase1(const char *ident)
 	interp->edata = pllua_make_recursive_error();
 
 	interp->gc_debt = 0;
+	interp->gc_debt_carried = false;
+	interp->alloc_bytes = 0;
+	interp->ndatums = 0;
+	interp->gc_generational = false;
 	interp->user_id = InvalidOid;
 	interp->db_ready = false;
 
@@ -952,6 +1434,7 @@ pllua_newstate_phase1(const char *ident)
 	interp->cur_activation.interp = NULL;
 	interp->cur_activation.active_error = LUA_REFNIL;
 	interp->cur_activation.err_text = NULL;
+	interp->cur_activation.stats = NULL;
 
 #if LUA_VERSION_NUM == 501
 	L = luaL_newstate();
@@ -11,6 +11,12 @@
 #include "utils/fmgrprotos.h"
 #endif
 #include "utils/jsonb.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/jsonapi.h"
+#include "utils/jsonfuncs.h"
+#else
+#include "utils/jsonapi.h"
+#endif
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
 #endif
@@ -19,22 +25,44 @@
 #define DatumGetJsonbP(d_) DatumGetJsonb(d_)
 #endif
 
+/* json semantic actions return an error code from pg16 on */
+#if PG_VERSION_NUM >= 160000
+#define PLLUA_JSON_ACTION JsonParseErrorType
+#define PLLUA_JSON_ACTION_RETURN return JSON_SUCCESS
+#else
+#define PLLUA_JSON_ACTION void
+#define PLLUA_JSON_ACTION_RETURN return
+#endif
+
+#ifndef JsonContainerIsArray
+#define JsonContainerIsScalar(jc_)	(((jc_)->header & JB_FSCALAR) != 0)
+#define JsonContainerIsObject(jc_)	(((jc_)->header & JB_FOBJECT) != 0)
+#define JsonContainerIsArray(jc_)	(((jc_)->header & JB_FARRAY) != 0)
+#define JsonContainerSize(jc_)		((jc_)->header & JB_CMASK)
+#endif
+
 /*
  * called with the container value on top of the stack
  *
  * Must push keytable, prevkey, index(=1)
- * where prevkey is nil for objects and 0 for arrays
+ * where prevkey is nil for objects and 0 for arrays, or false for objects
+ * whose keys came from a shape (see pllua_jsonb_shape); in the latter case,
+ * keys whose values are nil are skipped.
  *
  * For objects, keytable is a sequence of string or number keys. For arrays,
  * keytable is a sequence of integers in ascending order giving the "present"
  * keys.
  *
+ * *nelems is set to the expected number of entries in the result container,
+ * for presizing.
+ *
  * We already checked that this is a container (defined as a Lua table or a
  * value with a __pairs metamethod).
  *
  */
 static JsonbIteratorToken
-pllua_jsonb_pushkeys(lua_State *L, bool empty_object, int array_thresh, int array_frac)
+pllua_jsonb_pushkeys(lua_State *L, bool empty_object, int array_thresh, int array_frac,
+					 int *nelems)
 {
 	lua_Integer min_intkey = LUA_MAXINTEGER;
 	lua_Integer max_intkey = 0;
@@ -48,6 +76,7 @@ pllua_jsonb_pushkeys(lua_State *L, bool empty_object, int array_thresh, int arra
 	int numkeytabidx;
 	bool known_object = false;
 	bool known_array = false;
+	bool strintkeys = false;
 
 	switch (luaL_getmetafield(L, -1, "__jsonb_object"))
 	{
@@ -64,6 +93,27 @@ pllua_jsonb_pushkeys(lua_State *L, bool empty_object, int array_thresh, int arra
 			break;
 	}
 
+	/*
+	 * If the metatable supplies a shape, use its key list (which is already
+	 * sorted in jsonb order) directly and skip the classification pass.
+	 */
+	if (known_object)
+	{
+		switch (luaL_getmetafield(L, -1, "__jsonb_keys"))
+		{
+			case LUA_TTABLE:
+				*nelems = (int) lua_rawlen(L, -1);
+				lua_pushboolean(L, 0);
+				lua_pushinteger(L, 1);
+				return WJB_BEGIN_OBJECT;
+			default:
+				lua_pop(L, 1);
+				break;
+			case LUA_TNIL:
+				break;
+		}
+	}
+
 	lua_newtable(L);
 	keytabidx = lua_absindex(L, -1);
 
@@ -91,6 +141,8 @@ pllua_jsonb_pushkeys(lua_State *L, bool empty_object, int array_thresh, int arra
 			if (intval < min_intkey)
 				min_intkey = intval;
 			++numintkeys;
+			if (lua_type(L, -1) != LUA_TNUMBER)
+				strintkeys = true;
 			lua_pushvalue(L, -1);
 			lua_rawseti(L, numkeytabidx, numintkeys);
 		}
@@ -135,6 +187,7 @@ pllua_jsonb_pushkeys(lua_State *L, bool empty_object, int array_thresh, int arra
 	{
 		/* it's an object. Use the string key table */
 		lua_pop(L, 1);
+		*nelems = numkeys;
 		lua_pushnil(L);
 		lua_pushinteger(L, 1);
 		return WJB_BEGIN_OBJECT;
@@ -143,16 +196,62 @@ pllua_jsonb_pushkeys(lua_State *L, bool empty_object, int array_thresh, int arra
 	{
 		/* it's an array */
 		lua_remove(L, -2);
-		/* need to sort the array */
-		lua_getfield(L, lua_upvalueindex(1), "sort");
-		lua_pushvalue(L, -2);
-		lua_call(L, 1, 0);
+		if (!metaloop && !strintkeys
+			&& min_intkey == 1 && max_intkey == numkeys)
+		{
+			/*
+			 * The keys of a plain table are distinct, so here they must be
+			 * exactly 1..numkeys; no need to sort, just fill in the order.
+			 */
+			int i;
+			for (i = 1; i <= numkeys; ++i)
+			{
+				lua_pushinteger(L, i);
+				lua_rawseti(L, -2, i);
+			}
+		}
+		else
+		{
+			/* need to sort the array */
+			lua_getfield(L, lua_upvalueindex(1), "sort");
+			lua_pushvalue(L, -2);
+			lua_call(L, 1, 0);
+		}
+		*nelems = (numintkeys > 0 && max_intkey > 0 && max_intkey <= INT_MAX) ? (int) max_intkey : 0;
 		lua_pushinteger(L, 0);
 		lua_pushinteger(L, 1);
 		return WJB_BEGIN_ARRAY;
 	}
 }
 
+/*
+ * pushJsonbValue starts each container with room for only 4 entries and
+ * doubles it as needed; since we usually know the final size in advance,
+ * enlarge the just-begun container in one step instead.
+ */
+static void
+pllua_jsonb_presize(JsonbParseState *pstate, int nelems)
+{
+	if (nelems <= pstate->size)
+		return;
+
+	if (pstate->contVal.type == jbvObject)
+	{
+		nelems = Min(nelems, JSONB_MAX_PAIRS);
+		pstate->contVal.val.object.pairs
+			= repalloc(pstate->contVal.val.object.pairs,
+					   sizeof(JsonbPair) * nelems);
+	}
+	else
+	{
+		nelems = Min(nelems, JSONB_MAX_ELEMS);
+		pstate->contVal.val.array.elems
+			= repalloc(pstate->contVal.val.array.elems,
+					   sizeof(JsonbValue) * nelems);
+	}
+	pstate->size = nelems;
+}
+
 /*
  * Given a datum input, which might be json or jsonb or have a cast, figure out
  * what to put into JsonbValue. We're already in pg context in the temporary
@@ -323,6 +422,8 @@ pllua_jsonb_tosql(lua_State *L)
 	JsonbValue *volatile result;
 	volatile Datum datum;
 	pllua_datum *nd;
+	int keycacheidx;
+	int nelems = 0;
 
 	PLLUA_CHECK_PG_STACK_DEPTH();
 
@@ -372,6 +473,14 @@ pllua_jsonb_tosql(lua_State *L)
 	tmpcxt = pllua_newmemcontext(L, "pllua jsonb temp context",
 								 ALLOCSET_START_SMALL_SIZES);
 
+	/*
+	 * Cache of converted object keys, mapping the key string to a JsonbValue
+	 * in tmpcxt; arrays of similar objects repeat the same keys many times,
+	 * so this saves copying and verifying them each time.
+	 */
+	lua_newtable(L);
+	keycacheidx = lua_absindex(L, -1);
+
 	if (lua_rawequal(L, 1, nullvalue))
 	{
 		lua_pushnil(L);
@@ -405,7 +514,7 @@ pllua_jsonb_tosql(lua_State *L)
 		JsonbIteratorToken tok;
 		int depth = 1;
 
-		tok = pllua_jsonb_pushkeys(L, empty_object, array_thresh, array_frac);
+		tok = pllua_jsonb_pushkeys(L, empty_object, array_thresh, array_frac, &nelems);
 		/* stack: ... value=newcontainer newkeylist newprevkey newindex */
 		luaL_checkstack(L, 20, NULL);
 
@@ -413,6 +522,7 @@ pllua_jsonb_tosql(lua_State *L)
 		{
 			MemoryContext oldcontext = MemoryContextSwitchTo(tmpcxt);
 			pushJsonbValue(&pstate, tok, NULL);
+			pllua_jsonb_presize(pstate, nelems);
 			MemoryContextSwitchTo(oldcontext);
 		}
 		PLLUA_CATCH_RETHROW();
@@ -420,7 +530,7 @@ pllua_jsonb_tosql(lua_State *L)
 		/*
 		 * stack at loop top:
 		 *   [container keylist prevkey index]...
-		 * (prevkey is nil for objects)
+		 * (prevkey is nil or false for objects)
 		 *
 		 * do while depth:
 		 *   - if index beyond end of keylist:
@@ -448,7 +558,7 @@ pllua_jsonb_tosql(lua_State *L)
 			{
 				lua_pop(L, 1);
 
-				tok = lua_isnil(L, -2) ? WJB_END_OBJECT : WJB_END_ARRAY;
+				tok = (lua_type(L, -2) == LUA_TNUMBER) ? WJB_END_ARRAY : WJB_END_OBJECT;
 
 				PLLUA_TRY();
 				{
@@ -464,15 +574,35 @@ pllua_jsonb_tosql(lua_State *L)
 			else
 			{
 				JsonbValue *pval = NULL;
+				JsonbValue *volatile keyval = NULL;
+				bool		newkey = false;
 
 				lua_pushvalue(L, -1);
 				lua_gettable(L, -6);
 				/* stack: container keylist prevkey index key value */
+
+				if (lua_type(L, -4) != LUA_TNUMBER)
+				{
+					/* shape keys are only present if the value is */
+					if (lua_isboolean(L, -4) && lua_isnil(L, -1))
+					{
+						lua_pop(L, 2);
+						continue;
+					}
+					lua_tostring(L, -2);
+					lua_pushvalue(L, -2);
+					if (lua_rawget(L, keycacheidx) == LUA_TLIGHTUSERDATA)
+						keyval = lua_touserdata(L, -1);
+					else
+						newkey = true;
+					lua_pop(L, 1);
+				}
+
 				PLLUA_TRY();
 				{
 					MemoryContext oldcontext = MemoryContextSwitchTo(tmpcxt);
 
-					if (!lua_isnil(L, -4))
+					if (lua_type(L, -4) == LUA_TNUMBER)
 					{
 						int key = lua_tointeger(L, -2);
 						int prevkey = lua_tointeger(L, -4);
@@ -486,14 +616,19 @@ pllua_jsonb_tosql(lua_State *L)
 					}
 					else
 					{
-						size_t len = 0;
-						const char *ptr = lua_tolstring(L, -2, &len);
-						curval.type = jbvString;
-						curval.val.string.val = palloc(len);
-						curval.val.string.len = len;
-						memcpy(curval.val.string.val, ptr, len);
-						pg_verifymbstr(curval.val.string.val, len, false);
-						pushJsonbValue(&pstate, WJB_KEY, &curval);
+						if (newkey)
+						{
+							size_t len = 0;
+							const char *ptr = lua_tolstring(L, -2, &len);
+							JsonbValue *kv = palloc(sizeof(JsonbValue));
+							kv->type = jbvString;
+							kv->val.string.val = palloc(len);
+							kv->val.string.len = len;
+							memcpy(kv->val.string.val, ptr, len);
+							pg_verifymbstr(kv->val.string.val, len, false);
+							keyval = kv;
+						}
+						pushJsonbValue(&pstate, WJB_KEY, keyval);
 						tok = WJB_VALUE;
 					}
 
@@ -501,6 +636,13 @@ pllua_jsonb_tosql(lua_State *L)
 				}
 				PLLUA_CATCH_RETHROW();
 
+				if (newkey)
+				{
+					lua_pushvalue(L, -2);
+					lua_pushlightuserdata(L, keyval);
+					lua_rawset(L, keycacheidx);
+				}
+
 				lua_remove(L, -2);
 				/* stack: container keylist prevkey index value */
 				if (lua_rawequal(L, -1, nullvalue))
@@ -521,7 +663,7 @@ pllua_jsonb_tosql(lua_State *L)
 				}
 				else
 				{
-					tok = pllua_jsonb_pushkeys(L, empty_object, array_thresh, array_frac);
+					tok = pllua_jsonb_pushkeys(L, empty_object, array_thresh, array_frac, &nelems);
 					/* stack: ... value=newcontainer newkeylist newprevkey newindex */
 					luaL_checkstack(L, 20, NULL);
 					++depth;
@@ -531,6 +673,8 @@ pllua_jsonb_tosql(lua_State *L)
 				{
 					MemoryContext oldcontext = MemoryContextSwitchTo(tmpcxt);
 					pushJsonbValue(&pstate, tok, pval);
+					if (!pval)
+						pllua_jsonb_presize(pstate, nelems);
 					MemoryContextSwitchTo(oldcontext);
 				}
 				PLLUA_CATCH_RETHROW();
@@ -1174,130 +1318,1215 @@ pllua_jsonb_type(lua_State *L)
 	return 1;
 }
 
-
-static luaL_Reg jsonb_meta[] = {
-	{ "__call", pllua_jsonb_map },
-	{ "__pairs", pllua_jsonb_pairs },
-	{ "tosql", pllua_jsonb_tosql },
-	{ NULL, NULL }
+/*
+ * One step of a path given to get() or has().
+ */
+struct jsonb_path_elem
+{
+	const char *str;
+	size_t		len;
+	lua_Integer	idx;
+	bool		isint;
 };
 
 /*
- * Test whether a table returned from jsonb_map was originally an object or
- * array.
+ * Collect the path keys from stack index "firstarg" to the top of stack. We
+ * need both the string and integer forms of each key since we don't know
+ * until we get there whether we'll be looking in an object or an array; the
+ * string forms are pushed on the stack to keep them alive, along with the
+ * userdata holding the path array itself.
  */
-static int
-pllua_jsonb_table_is_object(lua_State *L)
+static struct jsonb_path_elem *
+pllua_jsonb_getpath(lua_State *L, int firstarg, int *npath)
 {
-	luaL_checktype(L, 1, LUA_TTABLE);
-	if (luaL_getmetafield(L, 1, "__jsonb_object") != LUA_TBOOLEAN)
-		return 0;
-	return 1;
+	int			nargs = lua_gettop(L) - firstarg + 1;
+	struct jsonb_path_elem *path;
+	int			i;
+
+	if (nargs < 0)
+		nargs = 0;
+
+	luaL_checkstack(L, nargs + 10, NULL);
+
+	path = lua_newuserdata(L, (nargs ? nargs : 1) * sizeof(struct jsonb_path_elem));
+
+	for (i = 0; i < nargs; ++i)
+	{
+		int			argn = firstarg + i;
+		int			isint = 0;
+
+		switch (lua_type(L, argn))
+		{
+			case LUA_TSTRING:
+			case LUA_TNUMBER:
+				break;
+			default:
+				luaL_argerror(L, argn, "string or integer expected");
+		}
+
+		path[i].idx = lua_tointegerx(L, argn, &isint);
+		path[i].isint = (isint != 0);
+		lua_pushvalue(L, argn);
+		path[i].str = lua_tolstring(L, -1, &path[i].len);
+	}
+
+	*npath = nargs;
+	return path;
 }
 
-static int
-pllua_jsonb_table_is_array(lua_State *L)
+/*
+ * Walk down from container "jc" following the path, using only the
+ * container lookup functions so that we never touch anything not on the path.
+ *
+ * Object members are looked up by the string form of the key; array elements
+ * by integer index, counting from 0, with negative values counting back from
+ * the end as for the SQL -> operator.
+ *
+ * Must be called in pg context. Returns false if the path doesn't exist;
+ * otherwise fills in *result, which points into the container's data.
+ */
+static bool
+pllua_jsonb_descend(JsonbContainer *jc,
+					struct jsonb_path_elem *path, int npath,
+					JsonbValue *result)
 {
-	luaL_checktype(L, 1, LUA_TTABLE);
-	if (luaL_getmetafield(L, 1, "__jsonb_object") != LUA_TBOOLEAN)
-		return 0;
-	lua_pushboolean(L, !lua_toboolean(L, -1));
-	return 1;
+	int			i;
+
+	for (i = 0; i < npath; ++i)
+	{
+		JsonbValue *v;
+
+		if (JsonContainerIsScalar(jc))
+			return false;
+
+		if (JsonContainerIsObject(jc))
+		{
+			JsonbValue	k;
+
+			k.type = jbvString;
+			k.val.string.val = (char *) path[i].str;
+			k.val.string.len = path[i].len;
+			v = findJsonbValueFromContainer(jc, JB_FOBJECT, &k);
+		}
+		else
+		{
+			lua_Integer	idx = path[i].idx;
+			lua_Integer	nelems = JsonContainerSize(jc);
+
+			if (!path[i].isint)
+				return false;
+			if (idx < 0)
+				idx += nelems;
+			if (idx < 0 || idx >= nelems)
+				return false;
+			v = getIthJsonbValueFromContainer(jc, (uint32) idx);
+		}
+
+		if (!v)
+			return false;
+
+		*result = *v;
+		pfree(v);
+
+		if (i < npath - 1)
+		{
+			if (result->type != jbvBinary)
+				return false;
+			jc = result->val.binary.data;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Push a single JsonbValue as a Lua value: scalars other than numbers become
+ * plain Lua values (json null becomes nil), numbers become numeric datums,
+ * and containers become new jsonb datums.
+ *
+ * Upvalues 2 and 3 are the jsonb and numeric typeinfos.
+ */
+static void
+pllua_jsonb_pushvalue(lua_State *L, JsonbValue *v)
+{
+	pllua_typeinfo *numt = *pllua_torefobject(L, lua_upvalueindex(3), PLLUA_TYPEINFO_OBJECT);
+
+	switch (v->type)
+	{
+		case jbvNull:
+			lua_pushnil(L);
+			break;
+		case jbvBool:
+			lua_pushboolean(L, v->val.boolean);
+			break;
+		case jbvNumeric:
+			pllua_datum_single(L, NumericGetDatum(v->val.numeric), false, lua_upvalueindex(3), numt);
+			break;
+		case jbvString:
+			lua_pushlstring(L, v->val.string.val, v->val.string.len);
+			break;
+		case jbvBinary:
+			{
+				pllua_datum *nd = pllua_newdatum(L, lua_upvalueindex(2), (Datum)0);
+
+				PLLUA_TRY();
+				{
+					MemoryContext oldcxt = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+					nd->value = PointerGetDatum(JsonbValueToJsonb(v));
+					nd->need_gc = true;
+					MemoryContextSwitchTo(oldcxt);
+					pllua_record_gc_debt(L, VARSIZE(DatumGetPointer(nd->value)));
+				}
+				PLLUA_CATCH_RETHROW();
+			}
+			break;
+		default:
+			luaL_error(L, "unexpected jsonb value type");
+	}
 }
 
+/*
+ * val = jsonb.get(jb, key, key, ...)
+ * bool = jsonb.has(jb, key, key, ...)
+ *
+ * (also available as methods on jsonb datums)
+ *
+ * Scalars come back as Lua values (numeric datums for numbers, nil for json
+ * nulls); containers come back as new jsonb datums which are a flat copy of
+ * just the relevant part of the original. With no keys, get() returns the
+ * value itself (or the scalar content of a scalar).
+ *
+ * upvalues as for jsonb_funcs.
+ */
 static int
-pllua_jsonb_table_set_table_mt(lua_State *L, const char *mtname)
+pllua_jsonb_get_common(lua_State *L, bool is_has)
 {
-	luaL_checktype(L, 1, LUA_TTABLE);
-	if (lua_getmetatable(L, 1))
+	pllua_datum *d = pllua_checkdatum(L, 1, lua_upvalueindex(2));
+	pllua_typeinfo *t = *pllua_torefobject(L, lua_upvalueindex(2), PLLUA_TYPEINFO_OBJECT);
+	struct jsonb_path_elem *path;
+	int			npath;
+	Jsonb	   *volatile jb = NULL;
+	volatile bool found = false;
+	volatile bool is_self = false;
+	JsonbValue	v;
+
+	if (t->typeoid != JSONBOID)
+		luaL_error(L, "datum is not of type jsonb");
+
+	path = pllua_jsonb_getpath(L, 2, &npath);
+
+	PLLUA_TRY();
 	{
-		lua_getfield(L, lua_upvalueindex(1), "object_mt");
-		if (!lua_rawequal(L, -1, -2))
+		/*
+		 * This can detoast, but only will for a value coming from a row (hence
+		 * a child datum) that has a short header or is compressed.
+		 */
+		jb = DatumGetJsonbP(d->value);
+
+		if (npath > 0)
+			found = pllua_jsonb_descend(&jb->root, path, npath, &v);
+		else if (JB_ROOT_IS_SCALAR(jb))
 		{
-			lua_getfield(L, lua_upvalueindex(1), "array_mt");
-			if (!lua_rawequal(L, -1, -3))
-				luaL_argerror(L, 1, "cannot replace existing metatable");
+			JsonbValue *pv = getIthJsonbValueFromContainer(&jb->root, 0);
+			v = *pv;
+			pfree(pv);
+			found = true;
 		}
+		else
+			found = is_self = true;
 	}
-	if (mtname)
-		lua_getfield(L, lua_upvalueindex(1), mtname);
-	else
+	PLLUA_CATCH_RETHROW();
+
+	if (is_has)
+		lua_pushboolean(L, found);
+	else if (!found)
 		lua_pushnil(L);
-	lua_setmetatable(L, 1);
-	lua_settop(L, 1);
-	return 1;
-}
+	else if (is_self)
+		lua_pushvalue(L, 1);
+	else
+		pllua_jsonb_pushvalue(L, &v);
 
-static int
-pllua_jsonb_table_set_object(lua_State *L)
-{
-	return pllua_jsonb_table_set_table_mt(L, "object_mt");
+	PLLUA_TRY();
+	{
+		if ((Pointer)jb != DatumGetPointer(d->value))
+			pfree(jb);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
 }
 
 static int
-pllua_jsonb_table_set_array(lua_State *L)
+pllua_jsonb_get(lua_State *L)
 {
-	return pllua_jsonb_table_set_table_mt(L, "array_mt");
+	return pllua_jsonb_get_common(L, false);
 }
 
 static int
-pllua_jsonb_table_set_unknown(lua_State *L)
+pllua_jsonb_has(lua_State *L)
 {
-	return pllua_jsonb_table_set_table_mt(L, NULL);
+	return pllua_jsonb_get_common(L, true);
 }
 
-static luaL_Reg jsonb_funcs[] = {
-	{ "is_object", pllua_jsonb_table_is_object },
-	{ "is_array", pllua_jsonb_table_is_array },
-	{ "set_as_object", pllua_jsonb_table_set_object },
-	{ "set_as_array", pllua_jsonb_table_set_array },
-	{ "set_as_unknown", pllua_jsonb_table_set_unknown },
-	{ "pairs", pllua_jsonb_pairs },
-	{ "ipairs", pllua_jsonb_ipairs },
-	{ "type", pllua_jsonb_type },
-	{ NULL, NULL }
-};
 
-int pllua_open_jsonb(lua_State *L)
+#if PG_VERSION_NUM >= 120000
+/*
+ * jsonb.path(expr, [vars], [silent])
+ *
+ * Returns a path object holding the compiled jsonpath, together with the
+ * vars (converted to jsonb once, here) and silent flag to use when executing
+ * it. The object is a table:
+ *   [1] = jsonpath datum
+ *   [2] = jsonb datum of vars
+ *   [3] = silent flag
+ *   [4] = scratch memory context, reset on each execution
+ * with the private path_mt as metatable.
+ */
+static int
+pllua_jsonb_path_new(lua_State *L)
 {
-	lua_settop(L, 0);
-
-	lua_newtable(L);	/* module private data table at index 1 */
+	lua_settop(L, 3);
+	lua_createtable(L, 4, 0);
 
-	lua_pushcfunction(L, pllua_typeinfo_lookup);
-	lua_pushinteger(L, JSONBOID);
+	lua_getfield(L, lua_upvalueindex(1), "jsonpath_type");
+	lua_pushvalue(L, 1);
 	lua_call(L, 1, 1);
-	lua_setfield(L, 1, "jsonb_type");
+	if (lua_isnil(L, -1))
+		luaL_argerror(L, 1, "jsonpath expected");
+	lua_rawseti(L, 4, 1);
 
-	lua_pushcfunction(L, pllua_typeinfo_lookup);
-	lua_pushinteger(L, NUMERICOID);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	if (lua_isnil(L, 2))
+		lua_pushliteral(L, "{}");
+	else
+		lua_pushvalue(L, 2);
 	lua_call(L, 1, 1);
-	lua_setfield(L, 1, "numeric_type");
+	lua_rawseti(L, 4, 2);
 
-	luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
-	if (lua_getfield(L, -1, "table") != LUA_TTABLE)
-		luaL_error(L, "table package is not loaded");
-	if (lua_getfield(L, -1, "sort") != LUA_TFUNCTION)
-		luaL_error(L, "table.sort function not found");
-	lua_remove(L, -2);
-	lua_remove(L, -2);
-	lua_setfield(L, 1, "sort");
+	lua_pushboolean(L, lua_toboolean(L, 3));
+	lua_rawseti(L, 4, 3);
 
-	lua_newtable(L);
-	lua_pushboolean(L, 1);
-	lua_setfield(L, -2, "__metatable");
-	lua_pushboolean(L, 0);
-	lua_setfield(L, -2, "__jsonb_object");
-	lua_setfield(L, 1, "array_mt");
+	pllua_newmemcontext(L, "pllua jsonpath temp context",
+						ALLOCSET_START_SMALL_SIZES);
+	lua_rawseti(L, 4, 4);
 
-	lua_newtable(L);
-	lua_pushboolean(L, 1);
-	lua_setfield(L, -2, "__metatable");
-	lua_pushboolean(L, 1);
-	lua_setfield(L, -2, "__jsonb_object");
-	lua_setfield(L, 1, "object_mt");
+	lua_getfield(L, lua_upvalueindex(1), "path_mt");
+	lua_setmetatable(L, 4);
+	return 1;
+}
 
-	lua_newtable(L);  /* module table at index 2 */
+/*
+ * Execute one of the jsonb_path_* functions with the path object at index 1
+ * and the jsonb value at index 2. The result is allocated in the path's
+ * scratch context, which is reset first and returned in *mcxtp; returns false
+ * if the result was null.
+ */
+static bool
+pllua_jsonb_path_exec(lua_State *L, PGFunction fn, MemoryContext *mcxtp, Datum *result)
+{
+	pllua_datum *d = pllua_checkdatum(L, 2, lua_upvalueindex(2));
+	pllua_typeinfo *t = *pllua_torefobject(L, lua_upvalueindex(2), PLLUA_TYPEINFO_OBJECT);
+	pllua_datum *pd;
+	pllua_datum *vd;
+	void	  **mp;
+	MemoryContext mcxt;
+	bool silent;
+	int top;
+	volatile Datum res = (Datum) 0;
+	volatile bool isnull = true;
+
+	if (t->typeoid != JSONBOID)
+		luaL_error(L, "datum is not of type jsonb");
+
+	if (!lua_getmetatable(L, 1))
+		luaL_argerror(L, 1, "jsonb path object expected");
+	lua_getfield(L, lua_upvalueindex(1), "path_mt");
+	if (!lua_rawequal(L, -1, -2))
+		luaL_argerror(L, 1, "jsonb path object expected");
+	lua_pop(L, 2);
+
+	/* the datums are kept alive by the path object itself */
+	top = lua_gettop(L);
+	lua_rawgeti(L, 1, 1);
+	pd = pllua_toanydatum(L, -1, NULL);
+	lua_rawgeti(L, 1, 2);
+	vd = pllua_toanydatum(L, -1, NULL);
+	lua_rawgeti(L, 1, 3);
+	silent = lua_toboolean(L, -1);
+	lua_rawgeti(L, 1, 4);
+	mp = pllua_torefobject(L, -1, PLLUA_MCONTEXT_OBJECT);
+	lua_settop(L, top);
+
+	if (!pd || !vd || !mp || !*mp)
+		luaL_argerror(L, 1, "jsonb path object expected");
+	mcxt = *mp;
+	*mcxtp = mcxt;
+
+	PLLUA_TRY();
+	{
+		LOCAL_FCINFO(fcinfo, 4);
+		MemoryContext oldcxt;
+
+		MemoryContextReset(mcxt);
+		oldcxt = MemoryContextSwitchTo(mcxt);
+
+		InitFunctionCallInfoData(*fcinfo, NULL, 4, InvalidOid, NULL, NULL);
+		LFCI_ARG_VALUE(fcinfo,0) = d->value;
+		LFCI_ARGISNULL(fcinfo,0) = false;
+		LFCI_ARG_VALUE(fcinfo,1) = pd->value;
+		LFCI_ARGISNULL(fcinfo,1) = false;
+		LFCI_ARG_VALUE(fcinfo,2) = vd->value;
+		LFCI_ARGISNULL(fcinfo,2) = false;
+		LFCI_ARG_VALUE(fcinfo,3) = BoolGetDatum(silent);
+		LFCI_ARGISNULL(fcinfo,3) = false;
+
+		res = (*fn) (fcinfo);
+		isnull = fcinfo->isnull;
+
+		MemoryContextSwitchTo(oldcxt);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	*result = res;
+	return !isnull;
+}
+
+/*
+ * path(val) or path:query(val)
+ *
+ * Returns an iterator over the matched items, like jsonb.ipairs.
+ */
+static int
+pllua_jsonb_path_query(lua_State *L)
+{
+	pllua_typeinfo *t = *pllua_torefobject(L, lua_upvalueindex(2), PLLUA_TYPEINFO_OBJECT);
+	MemoryContext mcxt;
+	Datum		res;
+	pllua_datum *nd;
+
+	lua_settop(L, 2);
+
+	if (!pllua_jsonb_path_exec(L, jsonb_path_query_array, &mcxt, &res))
+		return 0;
+
+	nd = pllua_newdatum(L, lua_upvalueindex(2), res);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		pllua_savedatum(L, nd, t);
+		MemoryContextReset(mcxt);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_replace(L, 1);
+	return pllua_jsonb_pairs_common(L, true);
+}
+
+/*
+ * path:array(val)
+ *
+ * Returns all matched items as a single jsonb array.
+ */
+static int
+pllua_jsonb_path_array(lua_State *L)
+{
+	pllua_typeinfo *t = *pllua_torefobject(L, lua_upvalueindex(2), PLLUA_TYPEINFO_OBJECT);
+	MemoryContext mcxt;
+	Datum		res;
+	pllua_datum *nd;
+
+	lua_settop(L, 2);
+
+	if (!pllua_jsonb_path_exec(L, jsonb_path_query_array, &mcxt, &res))
+		return 0;
+
+	nd = pllua_newdatum(L, lua_upvalueindex(2), res);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		pllua_savedatum(L, nd, t);
+		MemoryContextReset(mcxt);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
+}
+
+/*
+ * path:first(val)
+ *
+ * Returns the first matched item, converted as for jsonb.get, or nil.
+ */
+static int
+pllua_jsonb_path_first(lua_State *L)
+{
+	MemoryContext mcxt;
+	Datum		res;
+	JsonbValue	v;
+
+	lua_settop(L, 2);
+
+	if (!pllua_jsonb_path_exec(L, jsonb_path_query_first, &mcxt, &res))
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+
+	PLLUA_TRY();
+	{
+		Jsonb	   *jb = DatumGetJsonbP(res);
+
+		if (JB_ROOT_IS_SCALAR(jb))
+		{
+			MemoryContext oldcxt = MemoryContextSwitchTo(mcxt);
+			v = *getIthJsonbValueFromContainer(&jb->root, 0);
+			MemoryContextSwitchTo(oldcxt);
+		}
+		else
+		{
+			v.type = jbvBinary;
+			v.val.binary.len = VARSIZE(jb) - VARHDRSZ;
+			v.val.binary.data = &jb->root;
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	pllua_jsonb_pushvalue(L, &v);
+
+	PLLUA_TRY();
+	{
+		MemoryContextReset(mcxt);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
+}
+
+/*
+ * path:exists(val)
+ *
+ * Returns true or false, or nil if the result is unknown (which can happen
+ * only for silent paths).
+ */
+static int
+pllua_jsonb_path_exists(lua_State *L)
+{
+	MemoryContext mcxt;
+	Datum		res;
+
+	lua_settop(L, 2);
+
+	if (!pllua_jsonb_path_exec(L, jsonb_path_exists, &mcxt, &res))
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_pushboolean(L, DatumGetBool(res));
+	return 1;
+}
+
+static int
+pllua_jsonb_path_tostring(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_rawgeti(L, 1, 1);
+	luaL_tolstring(L, -1, NULL);
+	return 1;
+}
+
+static luaL_Reg jsonb_path_meta[] = {
+	{ "__call", pllua_jsonb_path_query },
+	{ "__tostring", pllua_jsonb_path_tostring },
+	{ NULL, NULL }
+};
+
+static luaL_Reg jsonb_path_methods[] = {
+	{ "query", pllua_jsonb_path_query },
+	{ "array", pllua_jsonb_path_array },
+	{ "first", pllua_jsonb_path_first },
+	{ "exists", pllua_jsonb_path_exists },
+	{ NULL, NULL }
+};
+#else
+static int
+pllua_jsonb_path_new(lua_State *L)
+{
+	return luaL_error(L, "jsonpath is not supported in this version of postgresql");
+}
+#endif
+
+/*
+ * Parsing of json (as opposed to jsonb) text.
+ *
+ * We use the backend's json lexer and parser, but since the semantic actions
+ * are called in pg context, they can't build Lua values directly. Instead the
+ * parse records a flat list of events, which we then replay in Lua context
+ * to build the result (or to call the user's handlers). This still avoids
+ * the cost of converting to jsonb, which must sort and deduplicate keys and
+ * build the binary representation.
+ */
+typedef enum pllua_json_event_type
+{
+	PLLUA_JSON_OBJECT_START,
+	PLLUA_JSON_OBJECT_END,
+	PLLUA_JSON_ARRAY_START,
+	PLLUA_JSON_ARRAY_END,
+	PLLUA_JSON_KEY,
+	PLLUA_JSON_STRING,
+	PLLUA_JSON_NUMBER,
+	PLLUA_JSON_TRUE,
+	PLLUA_JSON_FALSE,
+	PLLUA_JSON_NULL
+} pllua_json_event_type;
+
+struct pllua_json_event
+{
+	pllua_json_event_type type;
+	int			len;
+	char	   *str;
+};
+
+struct pllua_json_events
+{
+	struct pllua_json_event *ev;
+	int			nev;
+	int			maxev;
+};
+
+static void
+pllua_json_add_event(struct pllua_json_events *evs,
+					 pllua_json_event_type type, char *str)
+{
+	struct pllua_json_event *ev;
+
+	if (evs->nev >= evs->maxev)
+	{
+		evs->maxev *= 2;
+		evs->ev = repalloc(evs->ev, evs->maxev * sizeof(struct pllua_json_event));
+	}
+	ev = &evs->ev[evs->nev++];
+	ev->type = type;
+	ev->str = str;
+	ev->len = str ? strlen(str) : 0;
+}
+
+static PLLUA_JSON_ACTION
+pllua_json_object_start(void *state)
+{
+	pllua_json_add_event(state, PLLUA_JSON_OBJECT_START, NULL);
+	PLLUA_JSON_ACTION_RETURN;
+}
+
+static PLLUA_JSON_ACTION
+pllua_json_object_end(void *state)
+{
+	pllua_json_add_event(state, PLLUA_JSON_OBJECT_END, NULL);
+	PLLUA_JSON_ACTION_RETURN;
+}
+
+static PLLUA_JSON_ACTION
+pllua_json_array_start(void *state)
+{
+	pllua_json_add_event(state, PLLUA_JSON_ARRAY_START, NULL);
+	PLLUA_JSON_ACTION_RETURN;
+}
+
+static PLLUA_JSON_ACTION
+pllua_json_array_end(void *state)
+{
+	pllua_json_add_event(state, PLLUA_JSON_ARRAY_END, NULL);
+	PLLUA_JSON_ACTION_RETURN;
+}
+
+static PLLUA_JSON_ACTION
+pllua_json_object_field_start(void *state, char *fname, bool isnull)
+{
+	pllua_json_add_event(state, PLLUA_JSON_KEY, fname);
+	PLLUA_JSON_ACTION_RETURN;
+}
+
+static PLLUA_JSON_ACTION
+pllua_json_scalar(void *state, char *token, JsonTokenType tokentype)
+{
+	switch (tokentype)
+	{
+		case JSON_TOKEN_STRING:
+			pllua_json_add_event(state, PLLUA_JSON_STRING, token);
+			break;
+		case JSON_TOKEN_NUMBER:
+			pllua_json_add_event(state, PLLUA_JSON_NUMBER, token);
+			break;
+		case JSON_TOKEN_TRUE:
+			pllua_json_add_event(state, PLLUA_JSON_TRUE, NULL);
+			break;
+		case JSON_TOKEN_FALSE:
+			pllua_json_add_event(state, PLLUA_JSON_FALSE, NULL);
+			break;
+		case JSON_TOKEN_NULL:
+			pllua_json_add_event(state, PLLUA_JSON_NULL, NULL);
+			break;
+		default:
+			elog(ERROR, "unexpected json token type %d", (int) tokentype);
+	}
+	PLLUA_JSON_ACTION_RETURN;
+}
+
+/*
+ * Parse the json value at index nd (a string, or a Datum of type json or
+ * text) into a list of events allocated in mcxt.
+ */
+static struct pllua_json_events *
+pllua_json_parse(lua_State *L, int nd, MemoryContext mcxt)
+{
+	struct pllua_json_events *volatile evs = NULL;
+	const char *str = NULL;
+	size_t		len = 0;
+	pllua_datum *d = NULL;
+	pllua_typeinfo *dt = NULL;
+
+	if (lua_type(L, nd) == LUA_TSTRING)
+		str = lua_tolstring(L, nd, &len);
+	else if ((d = pllua_toanydatum(L, nd, &dt)))
+	{
+		if (dt->basetype != JSONOID && dt->basetype != TEXTOID)
+			luaL_argerror(L, nd, "json or text value expected");
+		lua_pop(L, 1);
+	}
+	else
+		luaL_argerror(L, nd, "string or json value expected");
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(mcxt);
+		JsonLexContext *lex;
+		JsonSemAction sem;
+		struct pllua_json_events *e = palloc(sizeof(struct pllua_json_events));
+
+		e->nev = 0;
+		e->maxev = 64;
+		e->ev = palloc(e->maxev * sizeof(struct pllua_json_event));
+
+		if (d)
+		{
+			text	   *t = DatumGetTextPP(d->value);
+
+			str = VARDATA_ANY(t);
+			len = VARSIZE_ANY_EXHDR(t);
+		}
+		else
+			pg_verifymbstr(str, len, false);
+
+#if PG_VERSION_NUM >= 170000
+		lex = makeJsonLexContextCstringLen(NULL, str, len, GetDatabaseEncoding(), true);
+#elif PG_VERSION_NUM >= 130000
+		lex = makeJsonLexContextCstringLen((char *) str, len, GetDatabaseEncoding(), true);
+#else
+		lex = makeJsonLexContextCstringLen((char *) str, len, true);
+#endif
+
+		memset(&sem, 0, sizeof(sem));
+		sem.semstate = e;
+		sem.object_start = pllua_json_object_start;
+		sem.object_end = pllua_json_object_end;
+		sem.array_start = pllua_json_array_start;
+		sem.array_end = pllua_json_array_end;
+		sem.object_field_start = pllua_json_object_field_start;
+		sem.scalar = pllua_json_scalar;
+
+#if PG_VERSION_NUM >= 130000
+		pg_parse_json_or_ereport(lex, &sem);
+#else
+		pg_parse_json(lex, &sem);
+#endif
+
+		evs = e;
+		MemoryContextSwitchTo(oldcxt);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return evs;
+}
+
+/*
+ * Push the value of a scalar event. Upvalue 3 is the numeric typeinfo.
+ */
+static void
+pllua_json_push_scalar(lua_State *L, struct pllua_json_event *ev,
+					   int nullvalue, bool keep_numeric)
+{
+	switch (ev->type)
+	{
+		case PLLUA_JSON_STRING:
+			lua_pushlstring(L, ev->str, ev->len);
+			break;
+		case PLLUA_JSON_NUMBER:
+			if (keep_numeric)
+			{
+				lua_pushvalue(L, lua_upvalueindex(3));
+				lua_pushlstring(L, ev->str, ev->len);
+				lua_call(L, 1, 1);
+			}
+			else
+			{
+				int			isnum;
+				lua_Integer ival;
+				lua_Number	nval;
+
+				lua_pushlstring(L, ev->str, ev->len);
+				ival = lua_tointegerx(L, -1, &isnum);
+				if (isnum)
+					lua_pushinteger(L, ival);
+				else
+				{
+					nval = lua_tonumberx(L, -1, &isnum);
+					if (!isnum)
+						luaL_error(L, "invalid json number: %s", ev->str);
+					lua_pushnumber(L, nval);
+				}
+				lua_remove(L, -2);
+			}
+			break;
+		case PLLUA_JSON_TRUE:
+			lua_pushboolean(L, 1);
+			break;
+		case PLLUA_JSON_FALSE:
+			lua_pushboolean(L, 0);
+			break;
+		case PLLUA_JSON_NULL:
+			if (nullvalue)
+				lua_pushvalue(L, nullvalue);
+			else
+				lua_pushnil(L);
+			break;
+		default:
+			luaL_error(L, "unexpected json event");
+	}
+}
+
+/*
+ * jsonb.from_json(val, [config])
+ *
+ * config keys are "null" and "pg_numeric", as for jsonb mapping.
+ *
+ * Objects and arrays become tables marked as for jsonb mapping (so that
+ * converting them back to jsonb preserves their types).
+ */
+static int
+pllua_jsonb_from_json(lua_State *L)
+{
+	struct pllua_json_events *evs;
+	MemoryContext mcxt;
+	int			nullvalue = 0;
+	bool		keep_numeric = false;
+	int			depth = 0;
+	int			i;
+
+	PLLUA_CHECK_PG_STACK_DEPTH();
+
+	lua_settop(L, 2);
+
+	if (lua_type(L, 2) == LUA_TTABLE)
+	{
+		if (lua_getfield(L, 2, "pg_numeric") &&
+			lua_toboolean(L, -1))
+			keep_numeric = true;
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "null");
+		nullvalue = lua_absindex(L, -1);
+	}
+	else if (!lua_isnil(L, 2))
+		nullvalue = 2;
+
+	mcxt = pllua_newmemcontext(L, "pllua json parse context",
+							   ALLOCSET_START_SMALL_SIZES);
+
+	evs = pllua_json_parse(L, 1, mcxt);
+
+	/*
+	 * Each open array has the table and the current count on the stack;
+	 * each open object has the table, plus the key while a value is pending.
+	 */
+	for (i = 0; i < evs->nev; ++i)
+	{
+		struct pllua_json_event *ev = &evs->ev[i];
+
+		switch (ev->type)
+		{
+			case PLLUA_JSON_OBJECT_START:
+				luaL_checkstack(L, 10, NULL);
+				lua_newtable(L);
+				lua_getfield(L, lua_upvalueindex(1), "object_mt");
+				lua_setmetatable(L, -2);
+				++depth;
+				continue;
+			case PLLUA_JSON_ARRAY_START:
+				luaL_checkstack(L, 10, NULL);
+				lua_newtable(L);
+				lua_getfield(L, lua_upvalueindex(1), "array_mt");
+				lua_setmetatable(L, -2);
+				lua_pushinteger(L, 0);
+				++depth;
+				continue;
+			case PLLUA_JSON_KEY:
+				lua_pushlstring(L, ev->str, ev->len);
+				continue;
+			case PLLUA_JSON_ARRAY_END:
+				lua_pop(L, 1);
+				FALLTHROUGH; /* FALLTHROUGH */
+			case PLLUA_JSON_OBJECT_END:
+				--depth;
+				break;
+			default:
+				pllua_json_push_scalar(L, ev, nullvalue, keep_numeric);
+				break;
+		}
+
+		/* store the completed value into its parent, if any */
+		if (depth > 0)
+		{
+			if (lua_type(L, -2) == LUA_TNUMBER)
+			{
+				lua_Integer idx = lua_tointeger(L, -2) + 1;
+				lua_rawseti(L, -3, idx);
+				lua_pushinteger(L, idx);
+				lua_replace(L, -2);
+			}
+			else
+				lua_rawset(L, -3);
+		}
+	}
+
+	Assert(depth == 0);
+
+	PLLUA_TRY();
+	{
+		MemoryContextReset(mcxt);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
+}
+
+/*
+ * jsonb.scan_json(val, handlers)
+ *
+ * Calls the functions in the handlers table for each parse event, in
+ * document order:
+ *   object_start() object_end() array_start() array_end()
+ *   key(name)
+ *   scalar(value, typename)
+ * Missing handlers are skipped.
+ */
+static int
+pllua_jsonb_scan_json(lua_State *L)
+{
+	static const char *const handler_names[] = {
+		"object_start", "object_end", "array_start", "array_end",
+		"key", "scalar"
+	};
+	static const char *const scalar_types[] = {
+		"string", "number", "boolean", "boolean", "null"
+	};
+	struct pllua_json_events *evs;
+	MemoryContext mcxt;
+	bool		keep_numeric = false;
+	int			i;
+
+	PLLUA_CHECK_PG_STACK_DEPTH();
+
+	lua_settop(L, 2);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	/* handlers at index 3..8 */
+	for (i = 0; i < lengthof(handler_names); ++i)
+		lua_getfield(L, 2, handler_names[i]);
+
+	if (lua_getfield(L, 2, "pg_numeric") &&
+		lua_toboolean(L, -1))
+		keep_numeric = true;
+	lua_pop(L, 1);
+
+	mcxt = pllua_newmemcontext(L, "pllua json parse context",
+							   ALLOCSET_START_SMALL_SIZES);
+
+	evs = pllua_json_parse(L, 1, mcxt);
+
+	for (i = 0; i < evs->nev; ++i)
+	{
+		struct pllua_json_event *ev = &evs->ev[i];
+		int			hidx = 3 + (ev->type <= PLLUA_JSON_KEY ? (int) ev->type : 5);
+
+		if (lua_isnil(L, hidx))
+			continue;
+
+		lua_pushvalue(L, hidx);
+		switch (ev->type)
+		{
+			case PLLUA_JSON_OBJECT_START:
+			case PLLUA_JSON_OBJECT_END:
+			case PLLUA_JSON_ARRAY_START:
+			case PLLUA_JSON_ARRAY_END:
+				lua_call(L, 0, 0);
+				break;
+			case PLLUA_JSON_KEY:
+				lua_pushlstring(L, ev->str, ev->len);
+				lua_call(L, 1, 0);
+				break;
+			default:
+				pllua_json_push_scalar(L, ev, 0, keep_numeric);
+				lua_pushstring(L, scalar_types[ev->type - PLLUA_JSON_STRING]);
+				lua_call(L, 2, 0);
+				break;
+		}
+	}
+
+	PLLUA_TRY();
+	{
+		MemoryContextReset(mcxt);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 0;
+}
+
+static luaL_Reg jsonb_meta[] = {
+	{ "__call", pllua_jsonb_map },
+	{ "__pairs", pllua_jsonb_pairs },
+	{ "tosql", pllua_jsonb_tosql },
+	{ NULL, NULL }
+};
+
+/*
+ * Test whether a table returned from jsonb_map was originally an object or
+ * array.
+ */
+static int
+pllua_jsonb_table_is_object(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (luaL_getmetafield(L, 1, "__jsonb_object") != LUA_TBOOLEAN)
+		return 0;
+	return 1;
+}
+
+static int
+pllua_jsonb_table_is_array(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (luaL_getmetafield(L, 1, "__jsonb_object") != LUA_TBOOLEAN)
+		return 0;
+	lua_pushboolean(L, !lua_toboolean(L, -1));
+	return 1;
+}
+
+static int
+pllua_jsonb_table_set_table_mt(lua_State *L, const char *mtname)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (lua_getmetatable(L, 1))
+	{
+		lua_getfield(L, lua_upvalueindex(1), "object_mt");
+		if (!lua_rawequal(L, -1, -2))
+		{
+			lua_getfield(L, lua_upvalueindex(1), "array_mt");
+			if (!lua_rawequal(L, -1, -3))
+				luaL_argerror(L, 1, "cannot replace existing metatable");
+		}
+	}
+	if (mtname)
+		lua_getfield(L, lua_upvalueindex(1), mtname);
+	else
+		lua_pushnil(L);
+	lua_setmetatable(L, 1);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+pllua_jsonb_table_set_object(lua_State *L)
+{
+	return pllua_jsonb_table_set_table_mt(L, "object_mt");
+}
+
+static int
+pllua_jsonb_table_set_array(lua_State *L)
+{
+	return pllua_jsonb_table_set_table_mt(L, "array_mt");
+}
+
+static int
+pllua_jsonb_table_set_unknown(lua_State *L)
+{
+	return pllua_jsonb_table_set_table_mt(L, NULL);
+}
+
+/*
+ * jsonb.shape{ key, key, ... }
+ *
+ * Returns a metatable marking tables as objects with the given set of keys,
+ * so that conversion to jsonb need not scan the table to find its keys and
+ * type. The keys are stored sorted in jsonb order (shorter keys first, then
+ * bytewise), which lets the final sort of the object's keys be trivial.
+ */
+struct jsonb_shape_key
+{
+	const char *str;
+	size_t len;
+};
+
+static int
+pllua_jsonb_shape_cmp(const void *a, const void *b)
+{
+	const struct jsonb_shape_key *ka = a;
+	const struct jsonb_shape_key *kb = b;
+
+	if (ka->len != kb->len)
+		return (ka->len > kb->len) ? 1 : -1;
+	return memcmp(ka->str, kb->str, ka->len);
+}
+
+static int
+pllua_jsonb_shape(lua_State *L)
+{
+	struct jsonb_shape_key *keys;
+	int nkeys;
+	int nout = 0;
+	int i;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	for (nkeys = 0; lua_rawgeti(L, 1, nkeys + 1) != LUA_TNIL; ++nkeys)
+		lua_pop(L, 1);
+	lua_pop(L, 1);
+
+	keys = lua_newuserdata(L, (nkeys + 1) * sizeof(struct jsonb_shape_key));
+	lua_createtable(L, nkeys, 0);  /* keeps the key strings alive */
+
+	for (i = 0; i < nkeys; ++i)
+	{
+		/*
+		 * Numbers are not accepted: the key would become the string, and the
+		 * lookup by that string would then miss an integer key in the table.
+		 */
+		if (lua_rawgeti(L, 1, i + 1) != LUA_TSTRING)
+			luaL_error(L, "shape keys must be strings");
+		keys[i].str = lua_tolstring(L, -1, &keys[i].len);
+		lua_rawseti(L, 3, i + 1);
+	}
+
+	qsort(keys, nkeys, sizeof(struct jsonb_shape_key), pllua_jsonb_shape_cmp);
+
+	lua_newtable(L);
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "__metatable");
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "__jsonb_object");
+
+	lua_createtable(L, nkeys, 0);
+	for (i = 0; i < nkeys; ++i)
+	{
+		if (i > 0 && pllua_jsonb_shape_cmp(&keys[i], &keys[i - 1]) == 0)
+			continue;
+		lua_pushlstring(L, keys[i].str, keys[i].len);
+		lua_rawseti(L, -2, ++nout);
+	}
+	lua_setfield(L, -2, "__jsonb_keys");
+
+	return 1;
+}
+
+static luaL_Reg jsonb_funcs[] = {
+	{ "is_object", pllua_jsonb_table_is_object },
+	{ "is_array", pllua_jsonb_table_is_array },
+	{ "set_as_object", pllua_jsonb_table_set_object },
+	{ "set_as_array", pllua_jsonb_table_set_array },
+	{ "set_as_unknown", pllua_jsonb_table_set_unknown },
+	{ "shape", pllua_jsonb_shape },
+	{ "pairs", pllua_jsonb_pairs },
+	{ "ipairs", pllua_jsonb_ipairs },
+	{ "type", pllua_jsonb_type },
+	{ "get", pllua_jsonb_get },
+	{ "has", pllua_jsonb_has },
+	{ "path", pllua_jsonb_path_new },
+	{ "from_json", pllua_jsonb_from_json },
+	{ "scan_json", pllua_jsonb_scan_json },
+	{ NULL, NULL }
+};
+
+static luaL_Reg jsonb_methods[] = {
+	{ "get", pllua_jsonb_get },
+	{ "has", pllua_jsonb_has },
+	{ NULL, NULL }
+};
+
+/*
+ * __index(self,key)  upvalue 1 is the method table
+ *
+ * Anything that isn't a method is still an error, as it is for other datums
+ * that can't be indexed, so that a mistyped jb.key doesn't just give nil.
+ */
+static int
+pllua_jsonb_index(lua_State *L)
+{
+	lua_settop(L, 2);
+	if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL)
+		return 1;
+	return luaL_error(L, "datum is not an indexable type");
+}
+
+int pllua_open_jsonb(lua_State *L)
+{
+	lua_settop(L, 0);
+
+	lua_newtable(L);	/* module private data table at index 1 */
+
+	lua_pushcfunction(L, pllua_typeinfo_lookup);
+	lua_pushinteger(L, JSONBOID);
+	lua_call(L, 1, 1);
+	lua_setfield(L, 1, "jsonb_type");
+
+	lua_pushcfunction(L, pllua_typeinfo_lookup);
+	lua_pushinteger(L, NUMERICOID);
+	lua_call(L, 1, 1);
+	lua_setfield(L, 1, "numeric_type");
+
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+	if (lua_getfield(L, -1, "table") != LUA_TTABLE)
+		luaL_error(L, "table package is not loaded");
+	if (lua_getfield(L, -1, "sort") != LUA_TFUNCTION)
+		luaL_error(L, "table.sort function not found");
+	lua_remove(L, -2);
+	lua_remove(L, -2);
+	lua_setfield(L, 1, "sort");
+
+	lua_newtable(L);
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "__metatable");
+	lua_pushboolean(L, 0);
+	lua_setfield(L, -2, "__jsonb_object");
+	lua_setfield(L, 1, "array_mt");
+
+	lua_newtable(L);
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "__metatable");
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "__jsonb_object");
+	lua_setfield(L, 1, "object_mt");
+
+#if PG_VERSION_NUM >= 120000
+	lua_pushcfunction(L, pllua_typeinfo_lookup);
+	lua_pushinteger(L, JSONPATHOID);
+	lua_call(L, 1, 1);
+	lua_setfield(L, 1, "jsonpath_type");
+#endif
+
+	lua_newtable(L);  /* module table at index 2 */
 	lua_getfield(L, 1, "jsonb_type");	/* jsonb typeinfo at index 3 */
 	lua_getfield(L, 1, "numeric_type");  /* numeric's typeinfo at index 4 */
 
@@ -1314,6 +2543,34 @@ int pllua_open_jsonb(lua_State *L)
 	lua_pushvalue(L, 4);  /* third upvalue for jsonb metamethods */
 	luaL_setfuncs(L, jsonb_meta, 3);
 
+	/* override normal datum __index entry to look up our methods */
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 3);
+	lua_pushvalue(L, 4);
+	luaL_setfuncs(L, jsonb_methods, 3);
+	lua_pushcclosure(L, pllua_jsonb_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+#if PG_VERSION_NUM >= 120000
+	/* metatable for jsonpath objects */
+	lua_newtable(L);
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "__metatable");
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 3);
+	lua_pushvalue(L, 4);
+	luaL_setfuncs(L, jsonb_path_meta, 3);
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 3);
+	lua_pushvalue(L, 4);
+	luaL_setfuncs(L, jsonb_path_methods, 3);
+	lua_setfield(L, -2, "__index");
+	lua_setfield(L, 1, "path_mt");
+#endif
+
 	lua_pushvalue(L, 2);
 	return 1;
 }
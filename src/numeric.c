@@ -3,8 +3,13 @@
 #include "pllua.h"
 
 #include "catalog/pg_type.h"
+#include "utils/array.h"
+#include "utils/datum.h"
 #include "utils/numeric.h"
 #include "utils/builtins.h"
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
 
 enum num_method_id {
 	PLLUA_NUM_NONE = 0,
@@ -129,6 +134,345 @@ pllua_numeric_guts(lua_State *L, pllua_datum *d, pllua_typeinfo *t,
 	return DatumGetBool(bool_res);
 }
 
+/*
+ * Fast path for "small" values.
+ *
+ * Most numeric values seen in practice (money amounts, quantities, etc.)
+ * have few digits and a small scale. For these, we can do add, subtract,
+ * multiply, negate and compare on a scaled int64 representation, without
+ * going through the fmgr interface and without the allocations that the
+ * backend's NumericVar arithmetic does, building the result value directly.
+ * Anything else (NaN, large values or scales, division, overflow) goes the
+ * normal way.
+ *
+ * This requires knowing the on-disk format of numeric, which is not exposed
+ * by the server headers; but since that format is fixed for pg_upgrade
+ * compatibility, it's safe to duplicate the needed definitions here.
+ */
+
+typedef int16 pllua_numeric_digit;
+
+#define PLLUA_NBASE			10000
+#define PLLUA_DEC_DIGITS	4
+
+#define PLLUA_NUMERIC_SIGN_MASK		0xC000
+#define PLLUA_NUMERIC_NEG			0x4000
+#define PLLUA_NUMERIC_SHORT			0x8000
+#define PLLUA_NUMERIC_SPECIAL		0xC000
+#define PLLUA_NUMERIC_DSCALE_MASK	0x3FFF
+
+#define PLLUA_NUMERIC_SHORT_SIGN_MASK		0x2000
+#define PLLUA_NUMERIC_SHORT_DSCALE_MASK		0x1F80
+#define PLLUA_NUMERIC_SHORT_DSCALE_SHIFT	7
+#define PLLUA_NUMERIC_SHORT_WEIGHT_SIGN_MASK	0x0040
+#define PLLUA_NUMERIC_SHORT_WEIGHT_MASK		0x003F
+
+/*
+ * Values handled by the fast path are those with a scale of at most
+ * PLLUA_NUMERIC_SMALL_MAXSCALE whose scaled magnitude is less than
+ * PLLUA_NUMERIC_SMALL_LIMIT; this ensures that no intermediate step can
+ * overflow int64.
+ */
+#define PLLUA_NUMERIC_SMALL_MAXSCALE	15
+#define PLLUA_NUMERIC_SMALL_LIMIT		INT64CONST(1000000000000000000)
+
+static const int64 pllua_numeric_pow10[] = {
+	INT64CONST(1), INT64CONST(10), INT64CONST(100), INT64CONST(1000),
+	INT64CONST(10000), INT64CONST(100000), INT64CONST(1000000),
+	INT64CONST(10000000), INT64CONST(100000000), INT64CONST(1000000000),
+	INT64CONST(10000000000), INT64CONST(100000000000),
+	INT64CONST(1000000000000), INT64CONST(10000000000000),
+	INT64CONST(100000000000000), INT64CONST(1000000000000000),
+	INT64CONST(10000000000000000), INT64CONST(100000000000000000),
+	INT64CONST(1000000000000000000)
+};
+
+/*
+ * Decode a numeric value into *val * 10^-(*scale), if it's small enough.
+ *
+ * Values taken from tuple fields keep their 1-byte packed header, so those
+ * must be accepted here; only toasted (external or compressed) values are
+ * left to the slow path.
+ */
+static bool
+pllua_numeric_decode_small(Datum d, int64 *val, int *scale)
+{
+	const char *vptr = DatumGetPointer(d);
+	const char *ptr;
+	Size		len;
+	uint16		header;
+	int			weight;
+	int			dscale;
+	bool		neg;
+	int			hdrsz;
+	int			ndigits;
+	int64		acc = 0;
+	int			i;
+
+	if (VARATT_IS_EXTERNAL(vptr) || VARATT_IS_COMPRESSED(vptr))
+		return false;
+
+	ptr = VARDATA_ANY(vptr);
+	len = VARSIZE_ANY_EXHDR(vptr);
+	if (len < sizeof(uint16))
+		return false;
+
+	memcpy(&header, ptr, sizeof(uint16));
+
+	if ((header & PLLUA_NUMERIC_SIGN_MASK) == PLLUA_NUMERIC_SPECIAL)
+		return false;
+	else if ((header & PLLUA_NUMERIC_SIGN_MASK) == PLLUA_NUMERIC_SHORT)
+	{
+		neg = (header & PLLUA_NUMERIC_SHORT_SIGN_MASK) != 0;
+		dscale = (header & PLLUA_NUMERIC_SHORT_DSCALE_MASK) >> PLLUA_NUMERIC_SHORT_DSCALE_SHIFT;
+		weight = ((header & PLLUA_NUMERIC_SHORT_WEIGHT_SIGN_MASK) ? ~PLLUA_NUMERIC_SHORT_WEIGHT_MASK : 0)
+			| (header & PLLUA_NUMERIC_SHORT_WEIGHT_MASK);
+		hdrsz = sizeof(uint16);
+	}
+	else
+	{
+		int16		lweight;
+
+		if (len < sizeof(uint16) + sizeof(int16))
+			return false;
+		memcpy(&lweight, ptr + sizeof(uint16), sizeof(int16));
+		neg = (header & PLLUA_NUMERIC_SIGN_MASK) == PLLUA_NUMERIC_NEG;
+		dscale = header & PLLUA_NUMERIC_DSCALE_MASK;
+		weight = lweight;
+		hdrsz = sizeof(uint16) + sizeof(int16);
+	}
+
+	if (dscale > PLLUA_NUMERIC_SMALL_MAXSCALE)
+		return false;
+
+	ndigits = (len - hdrsz) / sizeof(pllua_numeric_digit);
+
+	for (i = 0; i < ndigits; ++i)
+	{
+		pllua_numeric_digit dig;
+		int			pow = PLLUA_DEC_DIGITS * (weight - i) + dscale;
+		int64		term;
+
+		memcpy(&dig, ptr + hdrsz + i * sizeof(pllua_numeric_digit), sizeof(pllua_numeric_digit));
+		if (dig == 0)
+			continue;
+		if (pow >= 0)
+		{
+			if (pow >= lengthof(pllua_numeric_pow10)
+				|| dig >= PLLUA_NUMERIC_SMALL_LIMIT / pllua_numeric_pow10[pow])
+				return false;
+			term = dig * pllua_numeric_pow10[pow];
+		}
+		else
+		{
+			/* digits beyond dscale should be zero, but check */
+			if (pow <= -PLLUA_DEC_DIGITS || (dig % pllua_numeric_pow10[-pow]) != 0)
+				return false;
+			term = dig / pllua_numeric_pow10[-pow];
+		}
+		acc += term;
+		if (acc >= PLLUA_NUMERIC_SMALL_LIMIT)
+			return false;
+	}
+
+	*val = neg ? -acc : acc;
+	*scale = dscale;
+	return true;
+}
+
+/*
+ * Build a numeric value from val * 10^-dscale, which must be in range for
+ * the fast path. Always uses the short format, which is what the backend
+ * would do for such values. Allocates in the current memory context.
+ */
+static Datum
+pllua_numeric_make_small(int64 val, int dscale)
+{
+	pllua_numeric_digit tmp[10];
+	pllua_numeric_digit digits[10];
+	uint64		uval = (val < 0) ? -(uint64) val : (uint64) val;
+	uint64		ip = uval / pllua_numeric_pow10[dscale];
+	uint64		fp = uval % pllua_numeric_pow10[dscale];
+	int			fgroups = (dscale + PLLUA_DEC_DIGITS - 1) / PLLUA_DEC_DIGITS;
+	int			n = 0;
+	int			lo;
+	int			hi;
+	int			weight;
+	int			ndigits;
+	int			i;
+	uint16		header;
+	Size		len;
+	char	   *result;
+
+	/* collect base-NBASE digits, least significant first */
+	fp *= pllua_numeric_pow10[fgroups * PLLUA_DEC_DIGITS - dscale];
+	for (i = 0; i < fgroups; ++i)
+	{
+		tmp[n++] = fp % PLLUA_NBASE;
+		fp /= PLLUA_NBASE;
+	}
+	while (ip > 0)
+	{
+		tmp[n++] = ip % PLLUA_NBASE;
+		ip /= PLLUA_NBASE;
+	}
+	weight = n - fgroups - 1;
+
+	/* strip leading and trailing zero digits */
+	lo = 0;
+	while (lo < n && tmp[lo] == 0)
+		++lo;
+	hi = n;
+	while (hi > lo && tmp[hi - 1] == 0)
+	{
+		--hi;
+		--weight;
+	}
+	ndigits = hi - lo;
+	for (i = 0; i < ndigits; ++i)
+		digits[i] = tmp[hi - 1 - i];
+
+	if (ndigits == 0)
+	{
+		weight = 0;
+		val = 0;
+	}
+
+	header = ((val < 0) ? (PLLUA_NUMERIC_SHORT | PLLUA_NUMERIC_SHORT_SIGN_MASK) : PLLUA_NUMERIC_SHORT)
+		| (dscale << PLLUA_NUMERIC_SHORT_DSCALE_SHIFT)
+		| ((weight < 0) ? PLLUA_NUMERIC_SHORT_WEIGHT_SIGN_MASK : 0)
+		| (weight & PLLUA_NUMERIC_SHORT_WEIGHT_MASK);
+
+	len = VARHDRSZ + sizeof(uint16) + ndigits * sizeof(pllua_numeric_digit);
+	result = palloc(len);
+	SET_VARSIZE(result, len);
+	memcpy(result + VARHDRSZ, &header, sizeof(uint16));
+	if (ndigits > 0)
+		memcpy(result + VARHDRSZ + sizeof(uint16), digits, ndigits * sizeof(pllua_numeric_digit));
+
+	return PointerGetDatum(result);
+}
+
+static bool
+pllua_numeric_rescale_small(int64 *val, int scale, int newscale)
+{
+	int64		mul;
+
+	if (scale == newscale)
+		return true;
+	mul = pllua_numeric_pow10[newscale - scale];
+	if (*val <= -(PLLUA_NUMERIC_SMALL_LIMIT / mul) || *val >= (PLLUA_NUMERIC_SMALL_LIMIT / mul))
+		return false;
+	*val *= mul;
+	return true;
+}
+
+static bool
+pllua_numeric_getarg_small(lua_State *L, int nd, pllua_datum *d, int64 *val, int *scale)
+{
+	if (d)
+		return pllua_numeric_decode_small(d->value, val, scale);
+
+	if (lua_type(L, nd) == LUA_TNUMBER)
+	{
+		int			isint = 0;
+		lua_Integer ival = lua_tointegerx(L, nd, &isint);
+
+		if (isint && ival > -PLLUA_NUMERIC_SMALL_LIMIT && ival < PLLUA_NUMERIC_SMALL_LIMIT)
+		{
+			*val = ival;
+			*scale = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Try the fast path for the op; returns true with the result pushed if it
+ * succeeded, otherwise false with nothing pushed.
+ *
+ * The result scales follow the backend's rules: max of the input scales for
+ * add and subtract, and the sum of the scales for multiply.
+ */
+static bool
+pllua_numeric_small_op(lua_State *L, int op, pllua_datum *d1, pllua_datum *d2)
+{
+	int64		v1;
+	int64		v2 = 0;
+	int64		res;
+	int			s1;
+	int			s2 = 0;
+	int			rscale;
+	pllua_datum *d;
+
+	if (!pllua_numeric_getarg_small(L, 1, d1, &v1, &s1))
+		return false;
+	if (op != PLLUA_NUM_UNM
+		&& !pllua_numeric_getarg_small(L, 2, d2, &v2, &s2))
+		return false;
+
+	switch (op)
+	{
+		case PLLUA_NUM_EQ:
+		case PLLUA_NUM_LT:
+		case PLLUA_NUM_LE:
+			rscale = Max(s1, s2);
+			if (!pllua_numeric_rescale_small(&v1, s1, rscale)
+				|| !pllua_numeric_rescale_small(&v2, s2, rscale))
+				return false;
+			lua_pushboolean(L, ((op == PLLUA_NUM_EQ) ? (v1 == v2)
+								: (op == PLLUA_NUM_LT) ? (v1 < v2)
+								: (v1 <= v2)));
+			return true;
+
+		case PLLUA_NUM_ADD:
+		case PLLUA_NUM_SUB:
+			rscale = Max(s1, s2);
+			if (!pllua_numeric_rescale_small(&v1, s1, rscale)
+				|| !pllua_numeric_rescale_small(&v2, s2, rscale))
+				return false;
+			res = (op == PLLUA_NUM_ADD) ? (v1 + v2) : (v1 - v2);
+			break;
+
+		case PLLUA_NUM_MUL:
+			rscale = s1 + s2;
+			if (rscale > PLLUA_NUMERIC_SMALL_MAXSCALE)
+				return false;
+			if (v2 != 0
+				&& ((v1 < 0) ? -v1 : v1) > (PLLUA_NUMERIC_SMALL_LIMIT - 1) / ((v2 < 0) ? -v2 : v2))
+				return false;
+			res = v1 * v2;
+			break;
+
+		case PLLUA_NUM_UNM:
+			rscale = s1;
+			res = -v1;
+			break;
+
+		default:
+			return false;
+	}
+
+	if (res <= -PLLUA_NUMERIC_SMALL_LIMIT || res >= PLLUA_NUMERIC_SMALL_LIMIT)
+		return false;
+
+	d = pllua_newdatum(L, lua_upvalueindex(1), (Datum)0);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		d->value = pllua_numeric_make_small(res, rscale);
+		d->need_gc = true;
+		MemoryContextSwitchTo(oldcontext);
+		pllua_record_gc_debt(L, VARSIZE(DatumGetPointer(d->value)));
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return true;
+}
+
 /*
  * note, this can leave extra values on stack
  */
@@ -183,6 +527,22 @@ pllua_numeric_handler(lua_State *L)
 
 	lua_settop(L, 2);
 
+	switch (op)
+	{
+		case PLLUA_NUM_EQ:
+		case PLLUA_NUM_LT:
+		case PLLUA_NUM_LE:
+		case PLLUA_NUM_ADD:
+		case PLLUA_NUM_SUB:
+		case PLLUA_NUM_MUL:
+		case PLLUA_NUM_UNM:
+			if (pllua_numeric_small_op(L, op, d1, d2))
+				return 1;
+			break;
+		default:
+			break;
+	}
+
 	if (op < PLLUA_NUM_LOG)
 	{
 		val1 = pllua_numeric_getarg(L, 1, d1);
@@ -329,6 +689,399 @@ pllua_numeric_tonumber(lua_State *L)
 	return 1;
 }
 
+/*
+ * Aggregation: num.sum(x), num.avg(x), num.minmax(x)
+ *
+ * x is a numeric[] datum, a Lua table treated as a sequence, or an iterator
+ * triple (func, state, control) of which the first result is used. Nulls in
+ * an array are skipped; for a table or iterator, the first nil ends the input,
+ * as it would for ipairs or a generic for loop.
+ *
+ * The sum is accumulated in a single accumulator, which holds a scaled int64
+ * while the fast-path rules above allow, and a numeric value in a private
+ * memory context otherwise; only the final result is returned as a datum.
+ * Results follow the SQL sum/avg/min/max aggregates, including returning nil
+ * for no input.
+ */
+struct pllua_numeric_accum
+{
+	MemoryContext mcxt;
+	int64		count;
+	bool		want_sum;
+	bool		want_minmax;
+	bool		is_small;		/* sum is in small_val/small_scale */
+	int64		small_val;
+	int			small_scale;
+	Datum		sum;			/* valid only if !is_small */
+	Datum		min;			/* valid only if count > 0 */
+	Datum		max;
+};
+
+/*
+ * Add a small value to the accumulator, if possible. Lua context is OK.
+ */
+static bool
+pllua_numeric_accum_small(struct pllua_numeric_accum *acc, int64 val, int scale)
+{
+	int64		accval = acc->small_val;
+	int			rscale = Max(acc->small_scale, scale);
+
+	if (!acc->is_small || acc->want_minmax)
+		return false;
+	if (!pllua_numeric_rescale_small(&accval, acc->small_scale, rscale)
+		|| !pllua_numeric_rescale_small(&val, scale, rscale))
+		return false;
+	accval += val;
+	if (accval <= -PLLUA_NUMERIC_SMALL_LIMIT || accval >= PLLUA_NUMERIC_SMALL_LIMIT)
+		return false;
+	acc->small_val = accval;
+	acc->small_scale = rscale;
+	++acc->count;
+	return true;
+}
+
+/*
+ * Add any numeric value to the accumulator. Must be in pg context.
+ */
+static void
+pllua_numeric_accum_datum(struct pllua_numeric_accum *acc, Datum val)
+{
+	MemoryContext oldcontext;
+	int64		sval;
+	int			sscale;
+
+	if (acc->want_sum
+		&& pllua_numeric_decode_small(val, &sval, &sscale)
+		&& pllua_numeric_accum_small(acc, sval, sscale))
+		return;
+
+	oldcontext = MemoryContextSwitchTo(acc->mcxt);
+
+	if (acc->want_sum)
+	{
+		Datum		newsum;
+
+		if (acc->is_small)
+		{
+			acc->sum = pllua_numeric_make_small(acc->small_val, acc->small_scale);
+			acc->is_small = false;
+		}
+		newsum = DirectFunctionCall2(numeric_add, acc->sum, val);
+		pfree(DatumGetPointer(acc->sum));
+		acc->sum = newsum;
+	}
+
+	if (acc->want_minmax)
+	{
+		if (acc->count == 0)
+		{
+			acc->min = datumCopy(val, false, -1);
+			acc->max = datumCopy(val, false, -1);
+		}
+		else if (DatumGetInt32(DirectFunctionCall2(numeric_cmp, val, acc->min)) < 0)
+		{
+			pfree(DatumGetPointer(acc->min));
+			acc->min = datumCopy(val, false, -1);
+		}
+		else if (DatumGetInt32(DirectFunctionCall2(numeric_cmp, val, acc->max)) > 0)
+		{
+			pfree(DatumGetPointer(acc->max));
+			acc->max = datumCopy(val, false, -1);
+		}
+	}
+
+	++acc->count;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Add the Lua value on top of the stack to the accumulator, and pop it.
+ * Upvalue 1 is the numeric typeinfo.
+ */
+static void
+pllua_numeric_accum_lua(lua_State *L, struct pllua_numeric_accum *acc)
+{
+	pllua_datum *d;
+	volatile Datum val;
+	bool		free_val = false;
+
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		return;
+	}
+
+	if (lua_type(L, -1) == LUA_TNUMBER)
+	{
+		int			isint = 0;
+		lua_Integer ival = lua_tointegerx(L, -1, &isint);
+		float8		f = isint ? 0 : lua_tonumber(L, -1);
+
+		if (isint
+			&& ival > -PLLUA_NUMERIC_SMALL_LIMIT && ival < PLLUA_NUMERIC_SMALL_LIMIT
+			&& pllua_numeric_accum_small(acc, ival, 0))
+		{
+			lua_pop(L, 1);
+			return;
+		}
+
+		PLLUA_TRY();
+		{
+			MemoryContext oldcontext = MemoryContextSwitchTo(acc->mcxt);
+			if (isint)
+				val = DirectFunctionCall1(int8_numeric, Int64GetDatumFast(ival));
+			else
+				val = DirectFunctionCall1(float8_numeric, Float8GetDatumFast(f));
+			MemoryContextSwitchTo(oldcontext);
+		}
+		PLLUA_CATCH_RETHROW();
+		free_val = true;
+	}
+	else
+	{
+		int64		sval;
+		int			sscale;
+
+		d = pllua_todatum(L, -1, lua_upvalueindex(1));
+		if (!d)
+		{
+			lua_pushvalue(L, lua_upvalueindex(1));
+			lua_insert(L, -2);
+			lua_call(L, 1, 1);
+			d = pllua_todatum(L, -1, lua_upvalueindex(1));
+			if (!d)
+				luaL_error(L, "numeric conversion did not yield a numeric datum");
+		}
+		if (pllua_numeric_decode_small(d->value, &sval, &sscale)
+			&& pllua_numeric_accum_small(acc, sval, sscale))
+		{
+			lua_pop(L, 1);
+			return;
+		}
+		val = d->value;
+	}
+
+	PLLUA_TRY();
+	{
+		pllua_numeric_accum_datum(acc, val);
+		if (free_val)
+			pfree(DatumGetPointer(val));
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_pop(L, 1);
+}
+
+/*
+ * Feed all the values from the args into the accumulator. Pushes the
+ * accumulator's memory context object.
+ */
+static void
+pllua_numeric_accum_args(lua_State *L, struct pllua_numeric_accum *acc)
+{
+	pllua_typeinfo *dt;
+	pllua_datum *d;
+
+	lua_settop(L, 3);
+
+	acc->mcxt = pllua_newmemcontext(L, "pllua numeric aggregate context",
+									ALLOCSET_START_SMALL_SIZES);
+	acc->count = 0;
+	acc->is_small = true;
+	acc->small_val = 0;
+	acc->small_scale = 0;
+	acc->sum = acc->min = acc->max = (Datum) 0;
+
+	switch (lua_type(L, 1))
+	{
+		case LUA_TTABLE:
+			{
+				lua_Integer i;
+
+				for (i = 1; lua_geti(L, 1, i) != LUA_TNIL; ++i)
+					pllua_numeric_accum_lua(L, acc);
+				lua_pop(L, 1);
+			}
+			break;
+
+		case LUA_TFUNCTION:
+			for (;;)
+			{
+				lua_pushvalue(L, 1);
+				lua_pushvalue(L, 2);
+				lua_pushvalue(L, 3);
+				lua_call(L, 2, 1);
+				if (lua_isnil(L, -1))
+				{
+					lua_pop(L, 1);
+					break;
+				}
+				lua_pushvalue(L, -1);
+				lua_replace(L, 3);
+				pllua_numeric_accum_lua(L, acc);
+			}
+			break;
+
+		case LUA_TUSERDATA:
+			if ((d = pllua_toanydatum(L, 1, &dt)))
+			{
+				lua_pop(L, 1);
+				if (dt->is_array && dt->elemtype == NUMERICOID)
+				{
+					/*
+					 * Array datums are normally held in expanded form, so
+					 * walk the element arrays of that directly rather than
+					 * flattening a copy of the whole thing.
+					 */
+					PLLUA_TRY();
+					{
+						Datum	   *elems;
+						bool	   *nulls;
+						int			nelems;
+						int			i;
+
+						if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(d->value)))
+						{
+							ExpandedArrayHeader *eah = (ExpandedArrayHeader *) DatumGetEOHP(d->value);
+
+							deconstruct_expanded_array(eah);
+							elems = eah->dvalues;
+							nulls = eah->dnulls;
+							nelems = eah->nelems;
+							for (i = 0; i < nelems; ++i)
+							{
+								if (!nulls || !nulls[i])
+									pllua_numeric_accum_datum(acc, elems[i]);
+							}
+						}
+						else
+						{
+							ArrayType  *arr = DatumGetArrayTypeP(d->value);
+
+							deconstruct_array(arr, NUMERICOID, -1, false, 'i',
+											  &elems, &nulls, &nelems);
+							for (i = 0; i < nelems; ++i)
+							{
+								if (!nulls[i])
+									pllua_numeric_accum_datum(acc, elems[i]);
+							}
+							pfree(elems);
+							pfree(nulls);
+							if ((Pointer) arr != DatumGetPointer(d->value))
+								pfree(arr);
+						}
+					}
+					PLLUA_CATCH_RETHROW();
+					break;
+				}
+			}
+			FALLTHROUGH; /* FALLTHROUGH */
+		default:
+			luaL_argerror(L, 1, "numeric array, table or iterator expected");
+	}
+}
+
+/*
+ * Push a numeric result value, which is copied.
+ */
+static void
+pllua_numeric_push_result(lua_State *L, Datum val)
+{
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(1));
+	pllua_datum *d = pllua_newdatum(L, lua_upvalueindex(1), val);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		pllua_savedatum(L, d, t);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+}
+
+static int
+pllua_numeric_sum_common(lua_State *L, bool is_avg)
+{
+	struct pllua_numeric_accum acc;
+	volatile Datum res = (Datum) 0;
+
+	acc.want_sum = true;
+	acc.want_minmax = false;
+	pllua_numeric_accum_args(L, &acc);
+
+	if (acc.count == 0)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(acc.mcxt);
+		if (acc.is_small)
+			acc.sum = pllua_numeric_make_small(acc.small_val, acc.small_scale);
+		if (is_avg)
+			res = DirectFunctionCall2(numeric_div, acc.sum,
+									  DirectFunctionCall1(int8_numeric,
+														  Int64GetDatumFast(acc.count)));
+		else
+			res = acc.sum;
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	pllua_numeric_push_result(L, res);
+
+	PLLUA_TRY();
+	{
+		MemoryContextReset(acc.mcxt);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
+}
+
+static int
+pllua_numeric_sum(lua_State *L)
+{
+	return pllua_numeric_sum_common(L, false);
+}
+
+static int
+pllua_numeric_avg(lua_State *L)
+{
+	return pllua_numeric_sum_common(L, true);
+}
+
+static int
+pllua_numeric_minmax(lua_State *L)
+{
+	struct pllua_numeric_accum acc;
+
+	acc.want_sum = false;
+	acc.want_minmax = true;
+	pllua_numeric_accum_args(L, &acc);
+
+	if (acc.count == 0)
+	{
+		lua_pushnil(L);
+		lua_pushnil(L);
+		return 2;
+	}
+
+	pllua_numeric_push_result(L, acc.min);
+	pllua_numeric_push_result(L, acc.max);
+
+	PLLUA_TRY();
+	{
+		MemoryContextReset(acc.mcxt);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 2;
+}
+
 
 static struct { const char *name; enum num_method_id id; } numeric_meta[] = {
 	{ "__add", PLLUA_NUM_ADD },
@@ -365,6 +1118,9 @@ static struct { const char *name; enum num_method_id id; } numeric_methods[] = {
 static luaL_Reg numeric_plain_methods[] = {
 	{ "tointeger", pllua_numeric_tointeger },
 	{ "tonumber", pllua_numeric_tonumber },
+	{ "sum", pllua_numeric_sum },
+	{ "avg", pllua_numeric_avg },
+	{ "minmax", pllua_numeric_minmax },
 	{ NULL, NULL }
 };
 
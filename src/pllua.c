@@ -94,6 +94,7 @@ Datum pllua_common_call(FunctionCallInfo fcinfo, bool trusted)
 	act.interp = NULL;
 	act.active_error = LUA_REFNIL;
 	act.err_text = NULL;
+	act.stats = NULL;
 
 #if PG_VERSION_NUM >= 110000
 	if (fcinfo->context && IsA(fcinfo->context, CallContext))
@@ -120,6 +121,14 @@ Datum pllua_common_call(FunctionCallInfo fcinfo, bool trusted)
 
 		interp = act.interp;
 
+		if (pllua_track_function_stats && fcinfo->flinfo)
+		{
+			act.stats = pllua_get_func_stats(fcinfo->flinfo->fn_oid);
+			/* don't count each row of a value-per-call SRF as a call */
+			if (!(funcact && funcact->thread))
+				++act.stats->calls;
+		}
+
 		if (funcact && funcact->thread)
 		{
 			/*
@@ -174,6 +183,7 @@ Datum pllua_common_validator(FunctionCallInfo fcinfo, bool trusted)
 	act.interp = NULL;
 	act.active_error = LUA_REFNIL;
 	act.err_text = NULL;
+	act.stats = NULL;
 
 	pllua_setcontext(NULL, PLLUA_CONTEXT_PG);
 
@@ -220,6 +230,7 @@ Datum pllua_common_inline(FunctionCallInfo fcinfo, bool trusted)
 	act.interp = NULL;
 	act.active_error = LUA_REFNIL;
 	act.err_text = "inline block entry";
+	act.stats = NULL;
 
 #if PG_VERSION_NUM >= 110000
 	act.atomic = act.cblock->atomic;
@@ -10,9 +10,13 @@
 #include "fmgr.h"
 #include "funcapi.h"
 
+#include "datatype/timestamp.h"
+#include "portability/instr_time.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
 #include "utils/memutils.h"
 #include "utils/palloc.h"
+#include "utils/tuplestore.h"
 
 #include "miscadmin.h"
 
@@ -111,11 +115,13 @@ typedef enum
 
 extern pllua_context_type pllua_context;
 extern bool pllua_pending_error;
+extern bool pllua_subxact_pending;
 
 #define ASSERT_PG_CONTEXT Assert(pllua_context == PLLUA_CONTEXT_PG)
 #define ASSERT_LUA_CONTEXT Assert(pllua_context == PLLUA_CONTEXT_LUA)
 
 void pllua_pending_error_violation(lua_State *L) pg_attribute_noreturn();
+void pllua_subxact_start_pending(lua_State *L);
 
 static inline pllua_context_type
 pllua_setcontext(lua_State *L, pllua_context_type newctx)
@@ -126,6 +132,12 @@ pllua_setcontext(lua_State *L, pllua_context_type newctx)
 		&& oldctx == PLLUA_CONTEXT_LUA
 		&& newctx == PLLUA_CONTEXT_PG)
 		pllua_pending_error_violation(L);
+	/* first pg access inside a pcall starts its subtransaction */
+	if (unlikely(pllua_subxact_pending)
+		&& L
+		&& oldctx == PLLUA_CONTEXT_LUA
+		&& newctx == PLLUA_CONTEXT_PG)
+		pllua_subxact_start_pending(L);
 	pllua_context = newctx;
 	return oldctx;
 }
@@ -155,11 +167,60 @@ pllua_setcontext(lua_State *L, pllua_context_type newctx)
 #define PLLUA_CHECK_PG_STACK_DEPTH()							\
 	do { if (stack_is_too_deep()) luaL_error(L, "stack depth exceeded"); } while (0)
 
+/*
+ * Phases of execution that are made visible to monitoring: as wait events
+ * (see pllua_phase_begin), and, if built with -DPLLUA_USE_SDT, as USDT probes
+ * named pllua:<phase>__start and pllua:<phase>__done.
+ */
+typedef enum pllua_phase
+{
+	PLLUA_PHASE_NEWSTATE,		/* creating an interpreter */
+	PLLUA_PHASE_COMPILE,		/* compiling a function */
+	PLLUA_PHASE_GC,				/* extra garbage collection */
+	PLLUA_PHASE_SUBXACT,		/* starting or ending a pcall subtransaction */
+	PLLUA_PHASE_SPI,			/* running an SPI call */
+	PLLUA_NUM_PHASES
+} pllua_phase;
+
+#ifdef PLLUA_USE_SDT
+#include <sys/sdt.h>
+#define PLLUA_PROBE(name_) DTRACE_PROBE(pllua, name_)
+#define PLLUA_PROBE1(name_, arg1_) DTRACE_PROBE1(pllua, name_, arg1_)
+#else
+#define PLLUA_PROBE(name_) ((void) 0)
+#define PLLUA_PROBE1(name_, arg1_) ((void) 0)
+#endif
+
 /*
  * Describes one call to the top-level handler.
  */
 struct pllua_interpreter;
 
+/*
+ * Datum finalizers queue values to be freed in batches of this size, or
+ * sooner once this many bytes are queued.
+ */
+#define PLLUA_PENDING_FREE_SIZE 256
+#define PLLUA_PENDING_FREE_BYTES (1024 * 1024)
+
+/*
+ * Per-function execution statistics, kept in a backend-local hash by function
+ * oid while pllua.track_function_stats is on; see profile.c.
+ */
+typedef struct pllua_func_stats
+{
+	Oid			fn_oid;			/* hash key, must be first */
+	int64		calls;
+	instr_time	compile_time;	/* finding or compiling the function */
+	instr_time	args_time;		/* converting arguments */
+	instr_time	exec_time;		/* running Lua code, including spi_time */
+	instr_time	spi_time;		/* inside SPI calls */
+	instr_time	result_time;	/* converting the result */
+	instr_time	gc_time;		/* extra GC and freeing datums on exit */
+	int64		alloc_bytes;	/* Lua memory allocated */
+	int64		subxacts;		/* subtransactions started by pcall */
+} pllua_func_stats;
+
 typedef struct pllua_activation_record
 {
 	FunctionCallInfo fcinfo;
@@ -178,6 +239,18 @@ typedef struct pllua_activation_record
 	/* for error context stuff */
 	struct pllua_interpreter *interp;
 	const char *err_text;
+
+	/* per-call resource limits, see pllua_setup_call_limits */
+	uint64		instr_count;	/* instructions run, to hook granularity */
+	TimestampTz	start_time;		/* 0 if no time limit */
+
+	/* execution statistics, NULL if not tracking */
+	pllua_func_stats *stats;
+	instr_time	spi_start;
+	uint64		alloc_start;
+
+	/* wait event to restore after an SPI call, see pllua_spi_enter */
+	uint32		spi_wait_event;
 } pllua_activation_record;
 
 typedef struct pllua_cache_inval
@@ -212,6 +285,10 @@ typedef struct pllua_interpreter
 	bool		db_ready;
 
 	unsigned long gc_debt;		/* estimated additional GC debt */
+	bool		gc_debt_carried;	/* debt skipped at a commit, see pllua_xact_callback */
+	uint64		alloc_bytes;	/* total bytes ever allocated by Lua */
+	int64		ndatums;		/* live datum objects */
+	bool		gc_generational;	/* collector mode last set */
 
 	/* state below must be saved/restored for recursive calls */
 	pllua_activation_record cur_activation;
@@ -227,6 +304,11 @@ typedef struct pllua_interpreter
 	/* buffer for warning system */
 	int			warncount;
 	char		warnbuf[PLLUA_WARNBUF_SIZE];
+
+	/* datum values waiting to be freed, see pllua_datum_gc */
+	int			npending_free;
+	Size		pending_free_bytes;
+	Datum		pending_free[PLLUA_PENDING_FREE_SIZE];
 } pllua_interpreter;
 
 typedef struct pllua_interpreter_hashent
@@ -275,6 +357,7 @@ typedef struct pllua_function_info
 	bool		readonly;
 	bool		is_trigger;
 	bool		is_event_trigger;
+	bool		trigger_rows_used;	/* body might refer to old/new args */
 
 	int			nargs;
 	bool		variadic;
@@ -488,6 +571,7 @@ extern char PLLUA_PORTALS[];
 extern char PLLUA_FUNCTION_OBJECT[];
 extern char PLLUA_ERROR_OBJECT[];
 extern char PLLUA_IDXLIST_OBJECT[];
+extern char PLLUA_COLSLOT_OBJECT[];
 extern char PLLUA_ACTIVATION_OBJECT[];
 extern char PLLUA_MCONTEXT_OBJECT[];
 extern char PLLUA_TYPEINFO_OBJECT[];
@@ -519,6 +603,11 @@ extern char PLLUA_SANDBOX_META[];
 /* init.c */
 
 pllua_interpreter *pllua_getstate(bool trusted, pllua_activation_record *act);
+HTAB *pllua_get_interp_hash(void);
+uint32 pllua_current_wait_event(void);
+uint32 pllua_phase_begin(pllua_phase phase);
+void pllua_phase_end(uint32 prev);
+void pllua_setup_call_limits(pllua_interpreter *interp, pllua_activation_record *act);
 
 /*
  * careful, mustn't throw
@@ -544,12 +633,17 @@ pllua_get_memory_cxt(lua_State *L)
 }
 
 int pllua_set_new_ident(lua_State *L);
-void pllua_run_extra_gc(lua_State *L, unsigned long gc_debt);
+unsigned long pllua_run_extra_gc(lua_State *L, unsigned long gc_debt, int step_limit);
+int pllua_run_deferred_gc(lua_State *L);
+int pllua_switch_gc_mode(lua_State *L);
 PGDLLEXPORT bool pllua_stack_is_too_deep(void);
 PGDLLEXPORT void pllua_stack_depth_error(void);
 
 extern bool pllua_track_gc_debt;
+extern bool pllua_gc_deferred;
+extern int pllua_gc_step_limit;
 extern bool pllua_do_install_globals;
+extern int pllua_shared_memory_size;
 
 /*
  * This is a macro because we want to avoid executing (sz_) at all if not tracking
@@ -577,6 +671,8 @@ void pllua_validate_function(lua_State *L, Oid fn_oid, bool trusted);
 /* datum.c */
 int pllua_open_pgtype(lua_State *L);
 
+void pllua_free_pending_datums(lua_State *L);
+
 void pllua_verify_encoding(lua_State *L, const char *str);
 bool pllua_verify_encoding_noerror(lua_State *L, const char *str);
 void *pllua_palloc(lua_State *L, size_t sz);
@@ -606,6 +702,7 @@ bool pllua_datum_from_value(lua_State *L, int nd,
 							bool *isnull,
 							const char **errstr);
 pllua_datum *pllua_newdatum(lua_State *L, int nt, Datum value);
+HeapTuple pllua_datum_modify_tuple(lua_State *L, int nd, HeapTuple tuple);
 int pllua_typeinfo_lookup(lua_State *L);
 pllua_typeinfo *pllua_newtypeinfo_raw(lua_State *L, Oid oid, int32 typmod, TupleDesc tupdesc);
 int pllua_typeinfo_parsetype(lua_State *L);
@@ -725,11 +822,27 @@ int pllua_open_paths(lua_State *L);
 /* preload.c */
 int pllua_preload_compat(lua_State *L);
 
+/* profile.c */
+void pllua_profile_hook(lua_State *L);
+Tuplestorestate *pllua_begin_materialize(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+
+pllua_func_stats *pllua_get_func_stats(Oid fn_oid);
+int pllua_interp_inventory(lua_State *L);
+
+extern bool pllua_profiling;
+extern int pllua_profile_interval;
+extern bool pllua_track_function_stats;
+
+/* shared.c */
+int pllua_open_shared(lua_State *L);
+void pllua_shared_init(void);
+
 /* spi.c */
 int pllua_open_spi(lua_State *L);
 
 int pllua_spi_convert_args(lua_State *L);
 int pllua_spi_prepare_result(lua_State *L);
+int pllua_spi_prepare_table_result(lua_State *L);
 int pllua_cursor_cleanup_portal(lua_State *L);
 
 int pllua_spi_newcursor(lua_State *L);
@@ -149,6 +149,8 @@ static inline lua_Integer luaL_optinteger(lua_State *L, int i, lua_Integer def)
 /*
  * Miscellaneous functions
  */
+#define lua_rawlen(L_,nd_) lua_objlen(L_,nd_)
+
 #define lua_getuservalue(L_,nd_) (lua_getfenv(L_,nd_), lua_type(L_,-1))
 #define lua_setuservalue(L_,nd_) lua_setfenv(L_,nd_)
 
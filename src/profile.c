@@ -0,0 +1,516 @@
+/* profile.c */
+
+#include "pllua.h"
+
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+
+/*
+ * This file has the sampling profiler, the per-function execution statistics
+ * and the interpreter inventory, all of which are backend-local.
+ *
+ * Sampling profiler.
+ *
+ * While profiling is enabled, the count hook (see pllua_hook) calls
+ * pllua_profile_hook, which takes a sample of the current Lua stack every
+ * pllua_profile_interval VM instructions. Samples are aggregated per distinct
+ * stack in a backend-local hash table, keyed by the stack in the "collapsed"
+ * format used by flamegraph tools: frames from outermost to innermost,
+ * separated by semicolons.
+ *
+ * Since this is driven by instruction counts, it measures where Lua code is
+ * spending its effort; time spent waiting inside C functions (such as SPI
+ * calls) does not generate samples.
+ *
+ * Nothing here is touched unless profiling has been started.
+ */
+
+PGDLLEXPORT Datum pllua_profile_start(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pllua_profile_stop(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pllua_profile_results(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pllua_function_stats(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pllua_function_stats_reset(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pllua_interpreters(PG_FUNCTION_ARGS);
+
+#if PG_VERSION_NUM >= 140000
+#define PLLUA_HASH_STRINGS HASH_STRINGS
+#else
+#define PLLUA_HASH_STRINGS 0
+#endif
+
+#define PLLUA_PROFILE_KEYLEN 1024
+#define PLLUA_PROFILE_FRAMELEN 128
+#define PLLUA_PROFILE_MAXDEPTH 64
+
+typedef struct pllua_profile_entry
+{
+	char		stack[PLLUA_PROFILE_KEYLEN];	/* hash key, must be first */
+	int64		samples;
+} pllua_profile_entry;
+
+bool pllua_profiling = false;
+int pllua_profile_interval = 0;
+
+static int64 pllua_profile_countdown = 0;
+static HTAB *pllua_profile_hash = NULL;
+
+static HTAB *pllua_func_stats_hash = NULL;
+
+/*
+ * Format one stack frame. We leave out C functions with no known name, since
+ * those are our own entry points; for Lua functions, the chunk name is the
+ * pllua function name (or "DO-block").
+ */
+static int
+pllua_profile_frame(lua_Debug *ar, char *buf)
+{
+	const char *src = ar->source;
+	char	   *p;
+	int			len;
+
+	if (*ar->what == 'C')
+	{
+		if (!ar->name)
+			return 0;
+		len = snprintf(buf, PLLUA_PROFILE_FRAMELEN, "%s [C]", ar->name);
+	}
+	else
+	{
+		if (*src == '=' || *src == '@')
+			++src;
+		if (ar->name)
+			len = snprintf(buf, PLLUA_PROFILE_FRAMELEN, "%s@%s:%d",
+						   ar->name, src, ar->currentline);
+		else
+			len = snprintf(buf, PLLUA_PROFILE_FRAMELEN, "%s:%d",
+						   src, ar->currentline);
+	}
+
+	if (len >= PLLUA_PROFILE_FRAMELEN)
+		len = PLLUA_PROFILE_FRAMELEN - 1;
+
+	/* frame separators and newlines would confuse consumers */
+	for (p = buf; p < buf + len; ++p)
+	{
+		if (*p == ';')
+			*p = ':';
+		else if (*p == '\n' || *p == '\r')
+			*p = ' ';
+	}
+	return len;
+}
+
+static void
+pllua_profile_sample(lua_State *L)
+{
+	char		frames[PLLUA_PROFILE_MAXDEPTH][PLLUA_PROFILE_FRAMELEN];
+	int			lens[PLLUA_PROFILE_MAXDEPTH];
+	char		key[PLLUA_PROFILE_KEYLEN];
+	lua_Debug	ar;
+	int			nframes = 0;
+	int			level;
+	int			total = 0;
+	int			pos = 0;
+	int			i;
+
+	for (level = 0;
+		 nframes < PLLUA_PROFILE_MAXDEPTH && lua_getstack(L, level, &ar);
+		 ++level)
+	{
+		int			len;
+
+		lua_getinfo(L, "Sln", &ar);
+		len = pllua_profile_frame(&ar, frames[nframes]);
+		if (len == 0)
+			continue;
+		/* keep the innermost frames if the whole stack won't fit */
+		if (total + len + 1 >= PLLUA_PROFILE_KEYLEN)
+			break;
+		total += len + 1;
+		lens[nframes++] = len;
+	}
+
+	if (nframes == 0)
+		return;
+
+	memset(key, 0, sizeof(key));
+	for (i = nframes - 1; i >= 0; --i)
+	{
+		memcpy(key + pos, frames[i], lens[i]);
+		pos += lens[i];
+		if (i > 0)
+			key[pos++] = ';';
+	}
+
+	PLLUA_TRY_ERROK();
+	{
+		pllua_profile_entry *ent;
+		bool		found;
+
+		ent = hash_search(pllua_profile_hash, key, HASH_ENTER, &found);
+		if (!found)
+			ent->samples = 0;
+		++ent->samples;
+	}
+	PLLUA_CATCH_RETHROW();
+}
+
+/*
+ * Called from the count hook while profiling.
+ */
+void
+pllua_profile_hook(lua_State *L)
+{
+	pllua_profile_countdown -= lua_gethookcount(L);
+	if (pllua_profile_countdown > 0)
+		return;
+	pllua_profile_countdown = pllua_profile_interval;
+	if (pllua_profile_hash)
+		pllua_profile_sample(L);
+}
+
+/*
+ * pllua_profile_start(interval integer)
+ *
+ * Discards any previous results and starts sampling every "interval" Lua
+ * instructions. Takes effect from the next entry to a pllua function.
+ */
+PG_FUNCTION_INFO_V1(pllua_profile_start);
+Datum
+pllua_profile_start(PG_FUNCTION_ARGS)
+{
+	int32		interval = PG_GETARG_INT32(0);
+	HASHCTL		hash_ctl;
+
+	if (interval < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pllua: profile sampling interval must be positive")));
+
+	pllua_profiling = false;
+	if (pllua_profile_hash)
+	{
+		hash_destroy(pllua_profile_hash);
+		pllua_profile_hash = NULL;
+	}
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = PLLUA_PROFILE_KEYLEN;
+	hash_ctl.entrysize = sizeof(pllua_profile_entry);
+	pllua_profile_hash = hash_create("PLLua profile",
+									 256,
+									 &hash_ctl,
+									 HASH_ELEM | PLLUA_HASH_STRINGS);
+
+	pllua_profile_interval = interval;
+	pllua_profile_countdown = interval;
+	pllua_profiling = true;
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * pllua_profile_stop()
+ *
+ * Stops sampling; the results so far are kept.
+ */
+PG_FUNCTION_INFO_V1(pllua_profile_stop);
+Datum
+pllua_profile_stop(PG_FUNCTION_ARGS)
+{
+	pllua_profiling = false;
+	PG_RETURN_VOID();
+}
+
+/*
+ * pllua_profile_results(OUT stack text, OUT samples bigint)
+ */
+PG_FUNCTION_INFO_V1(pllua_profile_results);
+Datum
+pllua_profile_results(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	HASH_SEQ_STATUS hash_seq;
+	pllua_profile_entry *ent;
+
+	tupstore = pllua_begin_materialize(fcinfo, &tupdesc);
+
+	if (pllua_profile_hash)
+	{
+		hash_seq_init(&hash_seq, pllua_profile_hash);
+		while ((ent = hash_seq_search(&hash_seq)) != NULL)
+		{
+			Datum		values[2];
+			bool		nulls[2] = { false, false };
+
+			values[0] = PointerGetDatum(cstring_to_text(ent->stack));
+			values[1] = Int64GetDatum(ent->samples);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Execution statistics.
+ *
+ * While pllua.track_function_stats is on, each call records, in the entry
+ * for its function oid, the time spent in each phase of the call (see
+ * exec.c, and pllua_spi_enter/exit for SPI time) and the amount of Lua memory
+ * allocated. Only the time of the outermost phase is counted, so time in
+ * nested calls made through SPI counts as SPI time of the caller as well as
+ * being recorded for the callee.
+ *
+ * Called in PG context.
+ */
+pllua_func_stats *
+pllua_get_func_stats(Oid fn_oid)
+{
+	pllua_func_stats *ent;
+	bool		found;
+
+	if (!pllua_func_stats_hash)
+	{
+		HASHCTL		hash_ctl;
+
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(pllua_func_stats);
+		pllua_func_stats_hash = hash_create("PLLua function stats",
+											64,
+											&hash_ctl,
+											HASH_ELEM | HASH_BLOBS);
+	}
+
+	ent = hash_search(pllua_func_stats_hash, &fn_oid, HASH_ENTER, &found);
+	if (!found)
+	{
+		memset(ent, 0, sizeof(pllua_func_stats));
+		ent->fn_oid = fn_oid;
+	}
+	return ent;
+}
+
+/*
+ * pllua_function_stats(OUT funcid oid, OUT calls bigint, ...)
+ *
+ * Times are reported in milliseconds. lua_time is exec_time less spi_time.
+ */
+PG_FUNCTION_INFO_V1(pllua_function_stats);
+Datum
+pllua_function_stats(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	HASH_SEQ_STATUS hash_seq;
+	pllua_func_stats *ent;
+
+	tupstore = pllua_begin_materialize(fcinfo, &tupdesc);
+
+	if (pllua_func_stats_hash)
+	{
+		hash_seq_init(&hash_seq, pllua_func_stats_hash);
+		while ((ent = hash_seq_search(&hash_seq)) != NULL)
+		{
+			Datum		values[10];
+			bool		nulls[10];
+			instr_time	lua_time = ent->exec_time;
+
+			/* zeroed by a reset, and not called since */
+			if (ent->calls == 0)
+				continue;
+
+			INSTR_TIME_SUBTRACT(lua_time, ent->spi_time);
+
+			memset(nulls, 0, sizeof(nulls));
+			values[0] = ObjectIdGetDatum(ent->fn_oid);
+			values[1] = Int64GetDatum(ent->calls);
+			values[2] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(ent->compile_time));
+			values[3] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(ent->args_time));
+			values[4] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(lua_time));
+			values[5] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(ent->spi_time));
+			values[6] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(ent->result_time));
+			values[7] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(ent->gc_time));
+			values[8] = Int64GetDatum(ent->alloc_bytes);
+			values[9] = Int64GetDatum(ent->subxacts);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * pllua_function_stats_reset()
+ *
+ * Entries are only zeroed, not removed, since a running call might be
+ * pointing at one.
+ */
+PG_FUNCTION_INFO_V1(pllua_function_stats_reset);
+Datum
+pllua_function_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pllua_func_stats *ent;
+
+	if (pllua_func_stats_hash)
+	{
+		hash_seq_init(&hash_seq, pllua_func_stats_hash);
+		while ((ent = hash_seq_search(&hash_seq)) != NULL)
+		{
+			Oid			fn_oid = ent->fn_oid;
+
+			memset(ent, 0, sizeof(pllua_func_stats));
+			ent->fn_oid = fn_oid;
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Interpreter inventory.
+ *
+ * Counts the entries in the interpreter's caches; run via pllua_cpcall.
+ */
+typedef struct pllua_inventory
+{
+	int64		heap_bytes;
+	int64		nfuncs;
+	int64		ntypes;
+	int64		nrecords;
+	int64		nportals;
+} pllua_inventory;
+
+static int64
+pllua_count_registry_table(lua_State *L, void *key)
+{
+	int64		n = 0;
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, key);
+	if (lua_istable(L, -1))
+	{
+		lua_pushnil(L);
+		while (lua_next(L, -2))
+		{
+			++n;
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	return n;
+}
+
+int
+pllua_interp_inventory(lua_State *L)
+{
+	pllua_inventory *inv = lua_touserdata(L, 1);
+
+	inv->heap_bytes = (int64) lua_gc(L, LUA_GCCOUNT, 0) * 1024
+		+ lua_gc(L, LUA_GCCOUNTB, 0);
+	inv->nfuncs = pllua_count_registry_table(L, PLLUA_FUNCS);
+	inv->ntypes = pllua_count_registry_table(L, PLLUA_TYPES);
+	inv->nrecords = pllua_count_registry_table(L, PLLUA_RECORDS);
+	inv->nportals = pllua_count_registry_table(L, PLLUA_PORTALS);
+	return 0;
+}
+
+/*
+ * pllua_interpreters(OUT user_id oid, OUT trusted boolean, ...)
+ *
+ * One row per interpreter in this backend, excluding any held interpreters
+ * that have not been assigned to a user yet. Memory context sizes need
+ * PG 13 or later, and are null otherwise.
+ */
+PG_FUNCTION_INFO_V1(pllua_interpreters);
+Datum
+pllua_interpreters(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	HTAB	   *interp_hash = pllua_get_interp_hash();
+	HASH_SEQ_STATUS hash_seq;
+	pllua_interpreter_hashent *interp_desc;
+
+	tupstore = pllua_begin_materialize(fcinfo, &tupdesc);
+
+	if (!interp_hash)
+		return (Datum) 0;
+
+	hash_seq_init(&hash_seq, interp_hash);
+	while ((interp_desc = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pllua_interpreter *interp = interp_desc->interp;
+		pllua_inventory inv;
+		Datum		values[11];
+		bool		nulls[11];
+		int			rc;
+
+		if (!interp || !interp->L)
+			continue;
+
+		rc = pllua_cpcall(interp->L, pllua_interp_inventory, &inv);
+		if (rc)
+		{
+			hash_seq_term(&hash_seq);
+			pllua_rethrow_from_lua(interp->L, rc);
+		}
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(interp_desc->user_id);
+		values[1] = BoolGetDatum(interp_desc->trusted);
+		values[2] = Int64GetDatum(inv.heap_bytes);
+#if PG_VERSION_NUM >= 130000
+		values[3] = Int64GetDatum((int64) MemoryContextMemAllocated(interp->mcxt, true));
+		values[4] = Int64GetDatum((int64) MemoryContextMemAllocated(interp->emcxt, true));
+#else
+		nulls[3] = nulls[4] = true;
+#endif
+		values[5] = Int64GetDatum(inv.nfuncs);
+		values[6] = Int64GetDatum(inv.ntypes);
+		values[7] = Int64GetDatum(inv.nrecords);
+		values[8] = Int64GetDatum(inv.nportals);
+		values[9] = Int64GetDatum(interp->ndatums);
+		values[10] = Int64GetDatum((int64) interp->gc_debt);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Set up materialize-mode return for a set-returning function, returning the
+ * tuplestore and result tupdesc.
+ */
+Tuplestorestate *
+pllua_begin_materialize(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+
+	if (!rsinfo || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
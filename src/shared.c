@@ -0,0 +1,826 @@
+/* shared.c */
+
+/*
+ * pllua.shared: a key-value store visible to all backends.
+ *
+ * The store is a dshash table in a DSA area which is created in place in the
+ * main shared memory segment at postmaster start, so its size is fixed by
+ * pllua.shared_memory_size and it only exists if we were loaded via
+ * shared_preload_libraries (on PG 15+, which has the hooks and the dshash
+ * facilities we need).
+ *
+ * Values are serialized Lua scalars, strings, or flat tables of those. Every
+ * write takes a new value from a global version counter and stamps the entry
+ * with it. Readers keep a per-interpreter cache of decoded values, each
+ * recording the global version at which it was last known good; if the
+ * global version hasn't moved since then, the cached value is returned
+ * without taking any lock at all. Otherwise the entry's own version is
+ * checked under a shared partition lock, and the value is only copied and
+ * decoded again if it actually changed.
+ */
+
+#include "pllua.h"
+
+#if PG_VERSION_NUM >= 150000
+#include "lib/dshash.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/dsa.h"
+#endif
+
+#if PG_VERSION_NUM >= 150000
+
+/* keys are zero-padded to this size, so the max key length is one less */
+#define PLLUA_SHARED_KEYLEN 64
+
+/* don't bother with an area smaller than this */
+#define PLLUA_SHARED_MIN_SIZE (256 * 1024)
+
+/* max entries added to an interpreter's cache before we empty it */
+#define PLLUA_SHARED_CACHE_SIZE 1024
+
+/* tags for serialized values */
+#define PLLUA_SV_FALSE	'f'
+#define PLLUA_SV_TRUE	't'
+#define PLLUA_SV_INT	'i'
+#define PLLUA_SV_NUM	'd'
+#define PLLUA_SV_STR	's'
+#define PLLUA_SV_TABLE	'T'
+
+typedef struct pllua_shared_control
+{
+	int			tranche_id;
+	dshash_table_handle hash_handle;
+	pg_atomic_uint64 version;
+	/* the DSA area follows, at MAXALIGN(sizeof(pllua_shared_control)) */
+} pllua_shared_control;
+
+typedef struct pllua_shared_entry
+{
+	char		key[PLLUA_SHARED_KEYLEN];	/* hash key, must be first */
+	uint64		version;
+	dsa_pointer value;
+	Size		len;
+} pllua_shared_entry;
+
+static pllua_shared_control *pllua_shared_ctl = NULL;
+static dsa_area *pllua_shared_area = NULL;
+static dshash_table *pllua_shared_hash = NULL;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size
+pllua_shared_area_size(void)
+{
+	return Max((Size) pllua_shared_memory_size * 1024, PLLUA_SHARED_MIN_SIZE);
+}
+
+static Size
+pllua_shared_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(pllua_shared_control)),
+					pllua_shared_area_size());
+}
+
+static void *
+pllua_shared_area_place(void)
+{
+	return (char *) pllua_shared_ctl + MAXALIGN(sizeof(pllua_shared_control));
+}
+
+static void
+pllua_shared_params(dshash_parameters *params, int tranche_id)
+{
+	memset(params, 0, sizeof(dshash_parameters));
+	params->key_size = PLLUA_SHARED_KEYLEN;
+	params->entry_size = sizeof(pllua_shared_entry);
+	params->compare_function = dshash_memcmp;
+	params->hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+	params->copy_function = dshash_memcpy;
+#endif
+	params->tranche_id = tranche_id;
+}
+
+static void
+pllua_shared_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(pllua_shared_shmem_size());
+}
+
+/*
+ * Create the area and the hash table in the postmaster, as pgstat does for
+ * its own; the area is pinned and limited to its in-place size, so it never
+ * goes away and never grows into DSM segments.
+ */
+static void
+pllua_shared_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	pllua_shared_ctl = ShmemInitStruct("pllua shared store",
+									   pllua_shared_shmem_size(),
+									   &found);
+	if (!found)
+	{
+		dshash_parameters params;
+		dsa_area   *area;
+		dshash_table *hash;
+
+		pllua_shared_ctl->tranche_id = LWLockNewTrancheId();
+		pg_atomic_init_u64(&pllua_shared_ctl->version, 0);
+
+		area = dsa_create_in_place(pllua_shared_area_place(),
+								   pllua_shared_area_size(),
+								   pllua_shared_ctl->tranche_id,
+								   NULL);
+		dsa_pin(area);
+		dsa_set_size_limit(area, pllua_shared_area_size());
+
+		pllua_shared_params(&params, pllua_shared_ctl->tranche_id);
+		hash = dshash_create(area, &params, NULL);
+		pllua_shared_ctl->hash_handle = dshash_get_hash_table_handle(hash);
+
+		dshash_detach(hash);
+		dsa_detach(area);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Detach at backend exit. Attaching in place took a reference on the area
+ * which, with no DSM segment to hang it on, only we can release (pgstat does
+ * the same for its own in-place area).
+ */
+static void
+pllua_shared_detach(int code, Datum arg)
+{
+	if (!pllua_shared_area)
+		return;
+
+	dshash_detach(pllua_shared_hash);
+	dsa_detach(pllua_shared_area);
+	dsa_release_in_place(pllua_shared_area_place());
+
+	pllua_shared_hash = NULL;
+	pllua_shared_area = NULL;
+}
+
+/*
+ * Attach to the store on first use in this backend. The mapping stays for
+ * the life of the backend, and is released by pllua_shared_detach at exit.
+ */
+static void
+pllua_shared_attach(lua_State *L)
+{
+	if (pllua_shared_hash)
+		return;
+
+	if (!pllua_shared_ctl)
+		luaL_error(L, "pllua.shared is not available: pllua must be listed in shared_preload_libraries and pllua.shared_memory_size must be nonzero");
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		dshash_parameters params;
+		dsa_area   *area;
+
+		LWLockRegisterTranche(pllua_shared_ctl->tranche_id, "pllua_shared");
+
+		area = dsa_attach_in_place(pllua_shared_area_place(), NULL);
+		dsa_pin_mapping(area);
+
+		pllua_shared_params(&params, pllua_shared_ctl->tranche_id);
+		pllua_shared_hash = dshash_attach(area, &params,
+										  pllua_shared_ctl->hash_handle,
+										  NULL);
+		pllua_shared_area = area;
+
+		before_shmem_exit(pllua_shared_detach, (Datum) 0);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+}
+
+static void
+pllua_shared_checkkey(lua_State *L, int nd, char *keybuf)
+{
+	size_t		len;
+	const char *key = luaL_checklstring(L, nd, &len);
+
+	if (len >= PLLUA_SHARED_KEYLEN)
+		luaL_error(L, "pllua.shared: key is too long (maximum %d bytes)",
+				   PLLUA_SHARED_KEYLEN - 1);
+	if (strlen(key) != len)
+		luaL_error(L, "pllua.shared: key must not contain zero bytes");
+
+	memset(keybuf, 0, PLLUA_SHARED_KEYLEN);
+	memcpy(keybuf, key, len);
+}
+
+/*
+ * Serialization. This is done in two passes, the first of which checks that
+ * the value is storable and computes its size, so that the second can write
+ * into a buffer with no further allocation.
+ */
+static Size
+pllua_shared_value_size(lua_State *L, int nd, bool nested)
+{
+	switch (lua_type(L, nd))
+	{
+		case LUA_TBOOLEAN:
+			return 1;
+
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, nd))
+				return 1 + sizeof(lua_Integer);
+			return 1 + sizeof(lua_Number);
+
+		case LUA_TSTRING:
+			if (lua_rawlen(L, nd) > PG_UINT32_MAX)
+				luaL_error(L, "pllua.shared: string is too long");
+			return 1 + sizeof(uint32) + lua_rawlen(L, nd);
+
+		case LUA_TTABLE:
+			if (!nested)
+			{
+				Size		sz = 1 + sizeof(uint32);
+
+				nd = lua_absindex(L, nd);
+				luaL_checkstack(L, 10, NULL);
+				lua_pushnil(L);
+				while (lua_next(L, nd))
+				{
+					sz += pllua_shared_value_size(L, -2, true);
+					sz += pllua_shared_value_size(L, -1, true);
+					lua_pop(L, 1);
+				}
+				return sz;
+			}
+			luaL_error(L, "pllua.shared: nested tables cannot be stored");
+			break;
+
+		default:
+			luaL_error(L, "pllua.shared: cannot store a value of type %s",
+					   luaL_typename(L, nd));
+	}
+	return 0;
+}
+
+static char *
+pllua_shared_encode(lua_State *L, int nd, char *p)
+{
+	switch (lua_type(L, nd))
+	{
+		case LUA_TBOOLEAN:
+			*p++ = lua_toboolean(L, nd) ? PLLUA_SV_TRUE : PLLUA_SV_FALSE;
+			break;
+
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, nd))
+			{
+				lua_Integer i = lua_tointeger(L, nd);
+				*p++ = PLLUA_SV_INT;
+				memcpy(p, &i, sizeof(i));
+				p += sizeof(i);
+			}
+			else
+			{
+				lua_Number n = lua_tonumber(L, nd);
+				*p++ = PLLUA_SV_NUM;
+				memcpy(p, &n, sizeof(n));
+				p += sizeof(n);
+			}
+			break;
+
+		case LUA_TSTRING:
+			{
+				size_t		len;
+				const char *s = lua_tolstring(L, nd, &len);
+				uint32		len32 = (uint32) len;
+
+				*p++ = PLLUA_SV_STR;
+				memcpy(p, &len32, sizeof(len32));
+				p += sizeof(len32);
+				memcpy(p, s, len);
+				p += len;
+			}
+			break;
+
+		case LUA_TTABLE:
+			{
+				char	   *countp;
+				uint32		count = 0;
+
+				*p++ = PLLUA_SV_TABLE;
+				countp = p;
+				p += sizeof(uint32);
+
+				nd = lua_absindex(L, nd);
+				lua_pushnil(L);
+				while (lua_next(L, nd))
+				{
+					p = pllua_shared_encode(L, -2, p);
+					p = pllua_shared_encode(L, -1, p);
+					++count;
+					lua_pop(L, 1);
+				}
+				memcpy(countp, &count, sizeof(count));
+			}
+			break;
+	}
+	return p;
+}
+
+/* push the value at p, returning the position after it */
+static const char *
+pllua_shared_decode(lua_State *L, const char *p)
+{
+	switch (*p++)
+	{
+		case PLLUA_SV_FALSE:
+			lua_pushboolean(L, 0);
+			break;
+
+		case PLLUA_SV_TRUE:
+			lua_pushboolean(L, 1);
+			break;
+
+		case PLLUA_SV_INT:
+			{
+				lua_Integer i;
+				memcpy(&i, p, sizeof(i));
+				p += sizeof(i);
+				lua_pushinteger(L, i);
+			}
+			break;
+
+		case PLLUA_SV_NUM:
+			{
+				lua_Number	n;
+				memcpy(&n, p, sizeof(n));
+				p += sizeof(n);
+				lua_pushnumber(L, n);
+			}
+			break;
+
+		case PLLUA_SV_STR:
+			{
+				uint32		len;
+				memcpy(&len, p, sizeof(len));
+				p += sizeof(len);
+				lua_pushlstring(L, p, len);
+				p += len;
+			}
+			break;
+
+		case PLLUA_SV_TABLE:
+			{
+				uint32		count;
+				uint32		i;
+
+				memcpy(&count, p, sizeof(count));
+				p += sizeof(count);
+				luaL_checkstack(L, 10, NULL);
+				lua_createtable(L, 0, count);
+				for (i = 0; i < count; ++i)
+				{
+					p = pllua_shared_decode(L, p);
+					p = pllua_shared_decode(L, p);
+					lua_rawset(L, -3);
+				}
+			}
+			break;
+
+		default:
+			luaL_error(L, "pllua.shared: corrupt value");
+	}
+	return p;
+}
+
+/*
+ * Delete the key from the store, returning true if it was there.
+ */
+static bool
+pllua_shared_remove(lua_State *L, const char *key)
+{
+	bool		found = false;
+
+	PLLUA_TRY();
+	{
+		pllua_shared_entry *entry = dshash_find(pllua_shared_hash, key, true);
+
+		if (entry)
+		{
+			dsa_free(pllua_shared_area, entry->value);
+			dshash_delete_entry(pllua_shared_hash, entry);
+			pg_atomic_add_fetch_u64(&pllua_shared_ctl->version, 1);
+			found = true;
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return found;
+}
+
+/*
+ * The per-interpreter cache (upvalue 1 of the module functions) maps each key
+ * to { validated_at, version, value }. Rather than track usage, we bound its
+ * size by emptying it once enough entries have been added since the last
+ * time; the count is kept in the table itself, under the key true (real keys
+ * are always strings).
+ */
+static void
+pllua_shared_uncache(lua_State *L, int keynd)
+{
+	lua_pushvalue(L, keynd);
+	lua_pushnil(L);
+	lua_rawset(L, lua_upvalueindex(1));
+}
+
+static void
+pllua_shared_cache(lua_State *L, int keynd, int entnd)
+{
+	int			cache = lua_upvalueindex(1);
+	lua_Integer n;
+
+	lua_pushboolean(L, 1);
+	lua_rawget(L, cache);
+	n = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	if (n >= PLLUA_SHARED_CACHE_SIZE)
+	{
+		/* clearing existing fields during traversal is allowed */
+		lua_pushnil(L);
+		while (lua_next(L, cache))
+		{
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, cache);
+		}
+		n = 0;
+	}
+
+	lua_pushboolean(L, 1);
+	lua_pushinteger(L, n + 1);
+	lua_rawset(L, cache);
+
+	lua_pushvalue(L, keynd);
+	lua_pushvalue(L, entnd);
+	lua_rawset(L, cache);
+}
+
+/*
+ * Push the cached value at nd. Tables are copied, so that whatever the caller
+ * does with the result can't affect what later calls return.
+ */
+static void
+pllua_shared_pushvalue(lua_State *L, int nd)
+{
+	if (lua_type(L, nd) != LUA_TTABLE)
+	{
+		lua_pushvalue(L, nd);
+		return;
+	}
+
+	nd = lua_absindex(L, nd);
+	luaL_checkstack(L, 10, NULL);
+	lua_newtable(L);
+	lua_pushnil(L);
+	while (lua_next(L, nd))
+	{
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -4);
+	}
+}
+
+/*
+ * shared.get(key)
+ */
+static int
+pllua_shared_get(lua_State *L)
+{
+	char		key[PLLUA_SHARED_KEYLEN];
+	uint64		gv;
+	uint64		ev = 0;
+	uint64		cached_ev = 0;
+	char	   *buf = NULL;
+
+	pllua_shared_checkkey(L, 1, key);
+	lua_settop(L, 1);
+	pllua_shared_attach(L);
+
+	/*
+	 * Must read the global version before looking at the entry; a write that
+	 * we miss here will have bumped it, so we'll look again next time.
+	 */
+	gv = pg_atomic_read_u64(&pllua_shared_ctl->version);
+
+	lua_pushvalue(L, 1);
+	if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TTABLE)
+	{
+		lua_rawgeti(L, 2, 1);
+		if ((uint64) lua_tointeger(L, -1) == gv)
+		{
+			lua_rawgeti(L, 2, 3);
+			pllua_shared_pushvalue(L, -1);
+			return 1;
+		}
+		lua_rawgeti(L, 2, 2);
+		cached_ev = (uint64) lua_tointeger(L, -1);
+		lua_settop(L, 2);
+	}
+
+	PLLUA_TRY();
+	{
+		pllua_shared_entry *entry = dshash_find(pllua_shared_hash, key, false);
+
+		if (entry)
+		{
+			ev = entry->version;
+			if (ev != cached_ev)
+			{
+				buf = palloc(entry->len);
+				memcpy(buf,
+					   dsa_get_address(pllua_shared_area, entry->value),
+					   entry->len);
+			}
+			dshash_release_lock(pllua_shared_hash, entry);
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (ev == 0)
+	{
+		pllua_shared_uncache(L, 1);
+		return 0;
+	}
+
+	if (ev != cached_ev)
+	{
+		lua_settop(L, 1);
+		lua_createtable(L, 3, 0);
+		lua_pushinteger(L, (lua_Integer) ev);
+		lua_rawseti(L, 2, 2);
+		pllua_shared_decode(L, buf);
+		pfree(buf);
+		lua_rawseti(L, 2, 3);
+		pllua_shared_cache(L, 1, 2);
+	}
+
+	lua_pushinteger(L, (lua_Integer) gv);
+	lua_rawseti(L, 2, 1);
+	lua_rawgeti(L, 2, 3);
+	pllua_shared_pushvalue(L, -1);
+	return 1;
+}
+
+/*
+ * shared.set(key, value)
+ *
+ * Setting nil deletes the key. Returns the new version of the entry.
+ */
+static int
+pllua_shared_set(lua_State *L)
+{
+	char		key[PLLUA_SHARED_KEYLEN];
+	Size		len;
+	char	   *buf;
+	char	   *endp PG_USED_FOR_ASSERTS_ONLY;
+	uint64		ev = 0;
+
+	pllua_shared_checkkey(L, 1, key);
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+
+	if (lua_isnil(L, 2))
+	{
+		pllua_shared_attach(L);
+		pllua_shared_uncache(L, 1);
+		pllua_shared_remove(L, key);
+		return 0;
+	}
+
+	len = pllua_shared_value_size(L, 2, false);
+	if (len > MaxAllocSize)
+		luaL_error(L, "pllua.shared: value is too large");
+	buf = lua_newuserdata(L, len);
+	endp = pllua_shared_encode(L, 2, buf);
+	Assert(endp == buf + len);
+
+	pllua_shared_attach(L);
+	pllua_shared_uncache(L, 1);
+
+	PLLUA_TRY();
+	{
+		pllua_shared_entry *entry;
+		dsa_pointer value;
+		bool		found;
+
+		entry = dshash_find_or_insert(pllua_shared_hash, key, &found);
+		value = dsa_allocate_extended(pllua_shared_area, len, DSA_ALLOC_NO_OOM);
+		if (!DsaPointerIsValid(value))
+		{
+			if (found)
+				dshash_release_lock(pllua_shared_hash, entry);
+			else
+				dshash_delete_entry(pllua_shared_hash, entry);
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of pllua shared memory"),
+					 errhint("You might need to increase pllua.shared_memory_size.")));
+		}
+		memcpy(dsa_get_address(pllua_shared_area, value), buf, len);
+
+		if (found)
+			dsa_free(pllua_shared_area, entry->value);
+		entry->value = value;
+		entry->len = len;
+		entry->version = ev = pg_atomic_add_fetch_u64(&pllua_shared_ctl->version, 1);
+
+		dshash_release_lock(pllua_shared_hash, entry);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_pushinteger(L, (lua_Integer) ev);
+	return 1;
+}
+
+/*
+ * shared.delete(key)
+ */
+static int
+pllua_shared_delete(lua_State *L)
+{
+	char		key[PLLUA_SHARED_KEYLEN];
+
+	pllua_shared_checkkey(L, 1, key);
+	lua_settop(L, 1);
+	pllua_shared_attach(L);
+	pllua_shared_uncache(L, 1);
+
+	lua_pushboolean(L, pllua_shared_remove(L, key));
+	return 1;
+}
+
+/*
+ * shared.version([key])
+ *
+ * With no key, the global version, which changes on every write to any key;
+ * otherwise the version of that key's entry, or nil if it doesn't exist.
+ */
+static int
+pllua_shared_version(lua_State *L)
+{
+	char		key[PLLUA_SHARED_KEYLEN];
+	uint64		ev = 0;
+
+	if (lua_isnoneornil(L, 1))
+	{
+		pllua_shared_attach(L);
+		lua_pushinteger(L, (lua_Integer) pg_atomic_read_u64(&pllua_shared_ctl->version));
+		return 1;
+	}
+
+	pllua_shared_checkkey(L, 1, key);
+	pllua_shared_attach(L);
+
+	PLLUA_TRY();
+	{
+		pllua_shared_entry *entry = dshash_find(pllua_shared_hash, key, false);
+
+		if (entry)
+		{
+			ev = entry->version;
+			dshash_release_lock(pllua_shared_hash, entry);
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (ev == 0)
+		return 0;
+	lua_pushinteger(L, (lua_Integer) ev);
+	return 1;
+}
+
+/*
+ * shared.keys()
+ *
+ * Returns a table (sequence) of all keys currently present, in no
+ * particular order.
+ */
+static int
+pllua_shared_keys(lua_State *L)
+{
+	char		(*keys)[PLLUA_SHARED_KEYLEN] = NULL;
+	int			nkeys = 0;
+	int			i;
+
+	pllua_shared_attach(L);
+
+	PLLUA_TRY();
+	{
+		dshash_seq_status status;
+		pllua_shared_entry *entry;
+		int			nalloc = 16;
+
+		keys = palloc(nalloc * PLLUA_SHARED_KEYLEN);
+
+		dshash_seq_init(&status, pllua_shared_hash, false);
+		while ((entry = dshash_seq_next(&status)) != NULL)
+		{
+			if (nkeys >= nalloc)
+			{
+				nalloc *= 2;
+				keys = repalloc(keys, nalloc * PLLUA_SHARED_KEYLEN);
+			}
+			memcpy(keys[nkeys++], entry->key, PLLUA_SHARED_KEYLEN);
+		}
+		dshash_seq_term(&status);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_createtable(L, nkeys, 0);
+	for (i = 0; i < nkeys; ++i)
+	{
+		lua_pushstring(L, keys[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	pfree(keys);
+
+	return 1;
+}
+
+static struct luaL_Reg shared_funcs[] = {
+	{ "get", pllua_shared_get },
+	{ "set", pllua_shared_set },
+	{ "delete", pllua_shared_delete },
+	{ "version", pllua_shared_version },
+	{ "keys", pllua_shared_keys },
+	{ NULL, NULL }
+};
+
+#else /* PG_VERSION_NUM < 150000 */
+
+static int
+pllua_shared_unavailable(lua_State *L)
+{
+	return luaL_error(L, "pllua.shared requires PostgreSQL 15 or later");
+}
+
+static struct luaL_Reg shared_funcs[] = {
+	{ "get", pllua_shared_unavailable },
+	{ "set", pllua_shared_unavailable },
+	{ "delete", pllua_shared_unavailable },
+	{ "version", pllua_shared_unavailable },
+	{ "keys", pllua_shared_unavailable },
+	{ NULL, NULL }
+};
+
+#endif /* PG_VERSION_NUM >= 150000 */
+
+/*
+ * Called from _PG_init. The store only exists if we're being preloaded and
+ * have been given some memory for it.
+ */
+void
+pllua_shared_init(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (!process_shared_preload_libraries_in_progress
+		|| pllua_shared_memory_size == 0)
+		return;
+
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = pllua_shared_shmem_request;
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pllua_shared_shmem_startup;
+#endif
+}
+
+int pllua_open_shared(lua_State *L)
+{
+	lua_settop(L, 0);
+
+	lua_newtable(L);
+	lua_newtable(L);	/* value cache, as upvalue */
+	luaL_setfuncs(L, shared_funcs, 1);
+
+	return 1;
+}
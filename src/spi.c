@@ -11,6 +11,7 @@
 #include "executor/spi.h"
 #include "parser/analyze.h"
 #include "parser/parse_param.h"
+#include "utils/lsyscache.h"
 
 #if PG_VERSION_NUM >= 110000
 #define PortalGetHeapMemory(portal) ((portal)->portalContext)
@@ -90,14 +91,16 @@ static void pllua_spi_alloc_argspace(lua_State *L,
 static bool pllua_spi_enter(lua_State *L)
 {
 	bool readonly = pllua_get_cur_act_readonly(L);
+	pllua_activation_record *pact = &(pllua_getinterpreter(L)->cur_activation);
 	ASSERT_PG_CONTEXT;
+	if (pact->stats)
+		INSTR_TIME_SET_CURRENT(pact->spi_start);
+	pact->spi_wait_event = pllua_phase_begin(PLLUA_PHASE_SPI);
+	PLLUA_PROBE(spi__start);
 	SPI_connect();
 #if PG_VERSION_NUM >= 100000
-	{
-		pllua_activation_record *pact = &(pllua_getinterpreter(L)->cur_activation);
-		if (pact->fcinfo && CALLED_AS_TRIGGER(pact->fcinfo))
-			SPI_register_trigger_data((TriggerData *) pact->fcinfo->context);
-	}
+	if (pact->fcinfo && CALLED_AS_TRIGGER(pact->fcinfo))
+		SPI_register_trigger_data((TriggerData *) pact->fcinfo->context);
 #endif
 	return readonly;
 }
@@ -111,7 +114,16 @@ static int pllua_spi_is_readonly(lua_State *L)
 
 static void pllua_spi_exit(lua_State *L)
 {
+	pllua_activation_record *pact = &(pllua_getinterpreter(L)->cur_activation);
 	SPI_finish();
+	PLLUA_PROBE(spi__done);
+	pllua_phase_end(pact->spi_wait_event);
+	if (pact->stats)
+	{
+		instr_time now;
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_ACCUM_DIFF(pact->stats->spi_time, now, pact->spi_start);
+	}
 }
 
 /*
@@ -200,6 +212,227 @@ static void pllua_spi_save_result(lua_State *L, lua_Integer nrows)
 
 
 
+/*
+ * __index for table rows (see below). Only reached for column names, or for
+ * numbers of null columns.
+ *
+ * upvalue 1: attrs table of the result typeinfo
+ */
+static int pllua_spi_table_row_index(lua_State *L)
+{
+	if (lua_type(L, 2) != LUA_TSTRING)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushvalue(L, 2);
+	if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNUMBER)
+		luaL_error(L, "row has no column \"%s\"", lua_tostring(L, 2));
+	lua_rawget(L, 1);
+	return 1;
+}
+
+/*
+ * __newindex for table rows. Assignments by name are stored under the attno,
+ * and any key that isn't a column is rejected, so that rows keep their shape.
+ *
+ * upvalue 1: attrs table of the result typeinfo
+ * upvalue 2: natts
+ */
+static int pllua_spi_table_row_newindex(lua_State *L)
+{
+	lua_Integer natts = lua_tointeger(L, lua_upvalueindex(2));
+	lua_Integer attno;
+	int isint = 0;
+
+	lua_settop(L, 3);
+	if (lua_type(L, 2) == LUA_TSTRING)
+	{
+		lua_pushvalue(L, 2);
+		if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNUMBER)
+			luaL_error(L, "row has no column \"%s\"", lua_tostring(L, 2));
+		attno = lua_tointeger(L, -1);
+	}
+	else
+	{
+		attno = lua_tointegerx(L, 2, &isint);
+		if (!isint)
+			luaL_error(L, "invalid type for key field");
+	}
+	if (attno < 1 || attno > natts)
+		luaL_error(L, "row has no column number %d", (int) attno);
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, 1, attno);
+	return 0;
+}
+
+/*
+ * Alternative to pllua_spi_prepare_result + pllua_spi_save_result: convert
+ * the result into plain Lua tables, one per row, holding the column values
+ * by attno. All the rows share a single metatable (per result) which maps
+ * column names to attnos, so a row costs one table with only an array part,
+ * rather than a datum object with its own uservalue and, once used, its own
+ * deform table.
+ *
+ * Values with a direct Lua representation (and those with a fromsql
+ * transform) are converted eagerly, just as indexing a row datum would;
+ * anything else becomes a copied datum, which is left for the caller to
+ * convert (or not) as needed.
+ *
+ * Called in lua context, but before SPI_finish, so the tuple table is still
+ * valid.
+ *
+ * args: light[tuptab] nrows
+ * returns: table
+ */
+int pllua_spi_prepare_table_result(lua_State *L)
+{
+	SPITupleTable *tuptab = lua_touserdata(L, 1);
+	lua_Integer nrows = lua_tointeger(L, 2);
+	TupleDesc tupdesc = tuptab->tupdesc;
+	int natts = tupdesc->natts;
+	Datum values[MaxTupleAttributeNumber];
+	bool nulls[MaxTupleAttributeNumber];
+	bool detoast[MaxTupleAttributeNumber];
+	pllua_typeinfo *coltypes[MaxTupleAttributeNumber];
+	pllua_datum *savedatum[MaxTupleAttributeNumber];
+	int savecol[MaxTupleAttributeNumber];
+	pllua_typeinfo *t;
+	int tbase;
+	lua_Integer i;
+	int j;
+
+	lua_settop(L, 2);
+
+	if (tupdesc->tdtypeid == RECORDOID && tupdesc->tdtypmod < 0)
+		pllua_newtypeinfo_raw(L, tupdesc->tdtypeid, tupdesc->tdtypmod, tupdesc);
+	else
+	{
+		lua_pushcfunction(L, pllua_typeinfo_lookup);
+		lua_pushinteger(L, (lua_Integer) tupdesc->tdtypeid);
+		lua_pushinteger(L, (lua_Integer) tupdesc->tdtypmod);
+		lua_call(L, 2, 1);
+	}
+	t = pllua_checktypeinfo(L, 3, false);
+	if (t->natts != natts)
+		luaL_error(L, "result tupdesc does not match its type");
+
+	pllua_get_user_field(L, 3, "attrs");
+	pllua_get_user_field(L, 3, "attrtypes");
+
+	/* the shared metatable for all rows of this result */
+	lua_createtable(L, 0, 2);
+	lua_pushvalue(L, 4);
+	lua_pushcclosure(L, pllua_spi_table_row_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushvalue(L, 4);
+	lua_pushinteger(L, natts);
+	lua_pushcclosure(L, pllua_spi_table_row_newindex, 2);
+	lua_setfield(L, -2, "__newindex");
+
+	lua_createtable(L, nrows, 1);
+
+	/* stack: tuptab nrows typeinfo attrs attrtypes meta result coltypes... */
+
+	luaL_checkstack(L, natts + 20, NULL);
+	tbase = lua_gettop(L);
+	for (j = 0; j < natts; ++j)
+	{
+		if (lua_rawgeti(L, 5, j+1) == LUA_TNIL)
+			coltypes[j] = NULL;			/* dropped column */
+		else
+			coltypes[j] = pllua_checktypeinfo(L, -1, false);
+	}
+
+	PLLUA_TRY();
+	{
+		/* see pllua_datum_deform_tuple */
+		for (j = 0; j < natts; ++j)
+		{
+			Form_pg_attribute att = TupleDescAttr(tupdesc, j);
+			char typtype = ((att->attlen == -1 && !att->attisdropped)
+							? get_typtype(getBaseType(att->atttypid))
+							: '\0');
+			detoast[j] = (att->attlen == -1
+						  && (att->atttypid == RECORDOID ||
+							  typtype == TYPTYPE_RANGE ||
+							  typtype == TYPTYPE_COMPOSITE));
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	for (i = 0; i < nrows; ++i)
+	{
+		int nsave = 0;
+		int k;
+
+		PLLUA_TRY();
+		{
+			heap_deform_tuple(tuptab->vals[i], tupdesc, values, nulls);
+			for (j = 0; j < natts; ++j)
+			{
+				if (detoast[j] && !nulls[j]
+					&& VARATT_IS_EXTENDED(DatumGetPointer(values[j])))
+					values[j] = PointerGetDatum(PG_DETOAST_DATUM(values[j]));
+			}
+		}
+		PLLUA_CATCH_RETHROW();
+
+		lua_createtable(L, natts, 0);
+
+		for (j = 0; j < natts; ++j)
+		{
+			pllua_typeinfo *et = coltypes[j];
+
+			if (!et || nulls[j])
+				continue;
+
+			if (pllua_value_from_datum(L, values[j], et->basetype) == LUA_TNONE)
+			{
+				pllua_datum *newd = pllua_newdatum(L, tbase + 1 + j, values[j]);
+				if (et->typeoid != RECORDOID)
+					newd->typmod = TupleDescAttr(tupdesc, j)->atttypmod;
+				savedatum[nsave] = newd;
+				savecol[nsave++] = j;
+			}
+			lua_rawseti(L, -2, j+1);
+		}
+
+		if (nsave > 0)
+		{
+			PLLUA_TRY();
+			{
+				MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+				for (k = 0; k < nsave; ++k)
+					pllua_savedatum(L, savedatum[k], coltypes[savecol[k]]);
+				MemoryContextSwitchTo(oldcontext);
+			}
+			PLLUA_CATCH_RETHROW();
+
+			for (k = 0; k < nsave; ++k)
+			{
+				pllua_typeinfo *et = coltypes[savecol[k]];
+
+				if ((et->is_enum || OidIsValid(et->fromsql))
+					&& pllua_datum_transform_fromsql(L, savedatum[k]->value,
+													 tbase + 1 + savecol[k],
+													 et) != LUA_TNONE)
+					lua_rawseti(L, -2, savecol[k] + 1);
+			}
+		}
+
+		lua_pushvalue(L, 6);
+		lua_setmetatable(L, -2);
+		lua_rawseti(L, 7, i+1);
+	}
+
+	lua_settop(L, 7);
+	lua_pushinteger(L, nrows);
+	lua_setfield(L, -2, "n");
+	return 1;
+}
+
+
 static int pllua_cursor_options(lua_State *L, int nd, int *fetch_count)
 {
 	int n = 0;
@@ -559,8 +792,9 @@ pllua_spi_init_paramlist(int nargs, Datum *values, bool *isnull, Oid *types)
  * spi.execute_count(cmd, count, arg...) returns {rows...}
  * also stmt:execute_count(count, arg...)
  *
+ * If as_tables, rows are returned as plain tables rather than datums.
  */
-static int pllua_spi_execute_count(lua_State *L)
+static int pllua_spi_execute_guts(lua_State *L, bool as_tables)
 {
 	void **p = pllua_torefobject(L, 1, PLLUA_SPI_STMT_OBJECT);
 	const char *str = lua_tostring(L, 1);
@@ -661,13 +895,23 @@ static int pllua_spi_execute_count(lua_State *L)
 				 * idea if we can avoid it; in a long-running backend the
 				 * tupdescs can really pile up.
 				 */
-				pllua_pushcfunction(L, pllua_spi_prepare_result);
-				lua_pushlightuserdata(L, SPI_tuptable);
-				lua_pushinteger(L, nrows);
-				pllua_pcall(L, 2, 3, 0);
+				if (as_tables)
+				{
+					pllua_pushcfunction(L, pllua_spi_prepare_table_result);
+					lua_pushlightuserdata(L, SPI_tuptable);
+					lua_pushinteger(L, nrows);
+					pllua_pcall(L, 2, 1, 0);
+				}
+				else
+				{
+					pllua_pushcfunction(L, pllua_spi_prepare_result);
+					lua_pushlightuserdata(L, SPI_tuptable);
+					lua_pushinteger(L, nrows);
+					pllua_pcall(L, 2, 3, 0);
 
-				pllua_spi_save_result(L, nrows);
-				lua_pop(L, 1);
+					pllua_spi_save_result(L, nrows);
+					lua_pop(L, 1);
+				}
 			}
 			else
 				lua_pushinteger(L, nrows);
@@ -686,6 +930,16 @@ static int pllua_spi_execute_count(lua_State *L)
 	return 1;
 }
 
+static int pllua_spi_execute_count(lua_State *L)
+{
+	return pllua_spi_execute_guts(L, false);
+}
+
+static int pllua_spi_execute_count_tables(lua_State *L)
+{
+	return pllua_spi_execute_guts(L, true);
+}
+
 /*
  * spi.execute(cmd, arg...) returns {rows...}
  * also stmt:execute(arg...)
@@ -703,6 +957,51 @@ static int pllua_spi_execute(lua_State *L)
 	return lua_gettop(L);
 }
 
+/*
+ * spi.execute_tables(cmd, arg...) returns {rows...}
+ * also stmt:execute_tables(arg...)
+ *
+ * as spi.execute, but each row is a plain table sharing a per-result
+ * metatable; see pllua_spi_prepare_table_result
+ */
+static int pllua_spi_execute_tables(lua_State *L)
+{
+	luaL_checkany(L, 1);
+	lua_pushcfunction(L, pllua_spi_execute_count_tables);
+	lua_insert(L, 1);
+	lua_pushnil(L);
+	lua_insert(L, 3);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+/*
+ * spi.try_execute(cmd, arg...) returns {rows...} or nil, err
+ * also stmt:try_execute(arg...)
+ *
+ * Runs a statement, returning errors rather than throwing them. This is just
+ * pcall(spi.execute, ...) with a more convenient result, so it uses the same
+ * subxact stack (nothing else can recover from an error in the executor).
+ */
+static int pllua_spi_try_execute(lua_State *L)
+{
+	luaL_checkany(L, 1);
+	lua_pushcfunction(L, pllua_t_pcall);
+	lua_insert(L, 1);
+	lua_pushcfunction(L, pllua_spi_execute_count);
+	lua_insert(L, 2);
+	lua_pushnil(L);
+	lua_insert(L, 4);
+	lua_call(L, lua_gettop(L) - 1, 2);
+	if (!lua_toboolean(L, -2))
+	{
+		lua_pushnil(L);
+		lua_replace(L, -3);
+		return 2;
+	}
+	return 1;
+}
+
 /*
  * c:open(cmd, arg...)
  * c:open(stmt, arg...)
@@ -1429,7 +1728,7 @@ static int pllua_spi_xact(lua_State *L, bool commit)
 	pllua_interpreter *interp = pllua_getinterpreter(L);
 	if (interp->cur_activation.atomic)
 		luaL_error(L, "cannot commit or rollback in this context");
-	if (IsSubTransaction())
+	if (IsSubTransaction() || pllua_subxact_pending)
 		luaL_error(L, "cannot commit or rollback from inside a subtransaction");
 
 	PLLUA_TRY();
@@ -1469,6 +1768,8 @@ static int pllua_spi_is_atomic(lua_State *L)
 static struct luaL_Reg spi_funcs[] = {
 	{ "execute", pllua_spi_execute },
 	{ "execute_count", pllua_spi_execute_count },
+	{ "execute_tables", pllua_spi_execute_tables },
+	{ "try_execute", pllua_spi_try_execute },
 	{ "prepare", pllua_spi_prepare },
 	{ "readonly", pllua_spi_is_readonly },
 	{ "findcursor", pllua_spi_findcursor },
@@ -1516,6 +1817,8 @@ static struct luaL_Reg spi_stmt_methods[] = {
 	{ "issaved", pllua_spi_noop_true },
 	{ "execute", pllua_spi_execute },
 	{ "execute_count", pllua_spi_execute_count },
+	{ "execute_tables", pllua_spi_execute_tables },
+	{ "try_execute", pllua_spi_try_execute },
 	{ "getcursor", pllua_spi_stmt_getcursor },
 	{ "rows", pllua_spi_stmt_rows },
 	{ "numargs", pllua_stmt_numargs },
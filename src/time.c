@@ -5,6 +5,7 @@
 #include "pgtime.h"
 #include "catalog/pg_type.h"
 #include "datatype/timestamp.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/date.h"
 #include "utils/datetime.h"
@@ -15,6 +16,9 @@
 #include "utils/fmgrprotos.h"
 #endif
 #include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
 
 #ifndef DATETIME_MIN_JULIAN
 #define DATETIME_MIN_JULIAN (0)
@@ -35,6 +39,22 @@
 #define FSEC_T_SCALE(f_) ((int)(rint((f_) * 1000000.0)))
 #endif
 
+#ifndef TIMESTAMPTZARRAYOID
+#define TIMESTAMPTZARRAYOID 1185
+#endif
+
+/* microseconds between the Unix and PG epochs */
+#define PLLUA_EPOCH_DIFF_USEC \
+	((int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * INT64CONST(1000000))
+
+/*
+ * Lower limit of the timestamp range (4714-11-24 BC) in Unix-epoch
+ * microseconds. The upper limit is beyond the range of int64 in this form, so
+ * needs no check.
+ */
+#define PLLUA_MIN_EPOCH_USEC \
+	(INT64CONST(-211813488000000000) + PLLUA_EPOCH_DIFF_USEC)
+
 /* floor division assuming a positive divisor */
 static inline int64
 floordiv(int64 dividend, int64 divisor)
@@ -745,6 +765,212 @@ pllua_time_tosql(lua_State *L)
 }
 
 
+/*
+ * Broken-down form of a date, timestamp or timestamptz value.
+ *
+ * This is computed on first use and cached in the datum's uservalue, so that
+ * field access and as_table need only one timestamp2tm call per value rather
+ * than one fmgr call (and float8 result) per field. The timestamptz result
+ * depends on the session timezone, so we remember which one it was for.
+ */
+struct pllua_time_fields
+{
+	pg_tz	   *tz;				/* NULL unless timestamptz */
+	struct pg_tm tm;
+	int64		usec;
+	int			tzo;
+	const char *tzn;
+};
+
+/*
+ * Fields that can be served from pllua_time_fields. Anything else (including
+ * the various abbreviations accepted by the SQL functions) goes through
+ * pllua_time_part.
+ */
+enum pllua_time_field_id
+{
+	PLLUA_TIME_YEAR,
+	PLLUA_TIME_MONTH,
+	PLLUA_TIME_DAY,
+	PLLUA_TIME_HOUR,
+	PLLUA_TIME_MINUTE,
+	PLLUA_TIME_SECOND,
+	PLLUA_TIME_MICROSECONDS,
+	PLLUA_TIME_QUARTER,
+	PLLUA_TIME_DOW,
+	PLLUA_TIME_ISODOW,
+	PLLUA_TIME_DOY,
+	PLLUA_TIME_WEEK,
+	PLLUA_TIME_TIMEZONE
+};
+
+static struct { const char *name; enum pllua_time_field_id id; } time_fields[] = {
+	{ "year", PLLUA_TIME_YEAR },
+	{ "month", PLLUA_TIME_MONTH },
+	{ "day", PLLUA_TIME_DAY },
+	{ "hour", PLLUA_TIME_HOUR },
+	{ "minute", PLLUA_TIME_MINUTE },
+	{ "second", PLLUA_TIME_SECOND },
+	{ "microseconds", PLLUA_TIME_MICROSECONDS },
+	{ "quarter", PLLUA_TIME_QUARTER },
+	{ "dow", PLLUA_TIME_DOW },
+	{ "isodow", PLLUA_TIME_ISODOW },
+	{ "doy", PLLUA_TIME_DOY },
+	{ "week", PLLUA_TIME_WEEK },
+	{ "isoweek", PLLUA_TIME_WEEK },
+	{ "timezone", PLLUA_TIME_TIMEZONE },
+	{ NULL, 0 }
+};
+
+/*
+ * Get the (possibly cached) broken-down value of the datum at nd, or NULL if
+ * the type isn't one we handle or the value is infinite. The result lives in
+ * the datum's uservalue and remains valid for as long as the datum does.
+ */
+static struct pllua_time_fields *
+pllua_time_getfields(lua_State *L, int nd, pllua_datum *d, Oid oid)
+{
+	static struct pg_tm ztm = { 0 };
+	struct pllua_time_fields *f = NULL;
+	struct pllua_time_fields res;
+	pg_tz	   *tz = (oid == TIMESTAMPTZOID) ? session_timezone : NULL;
+
+	switch (oid)
+	{
+		case DATEOID:
+			if (DATE_NOT_FINITE(DatumGetDateADT(d->value)))
+				return NULL;
+			break;
+		case TIMESTAMPTZOID:
+		case TIMESTAMPOID:
+			if (TIMESTAMP_NOT_FINITE(DatumGetTimestamp(d->value)))
+				return NULL;
+			break;
+		default:
+			return NULL;
+	}
+
+	if (pllua_get_user_field(L, nd, ".tmfields") == LUA_TUSERDATA)
+	{
+		f = lua_touserdata(L, -1);
+		if (f->tz == tz)
+		{
+			lua_pop(L, 1);
+			return f;
+		}
+	}
+	lua_pop(L, 1);
+
+	res.tz = tz;
+	res.tm = ztm;
+	res.tm.tm_isdst = -1;
+	res.usec = 0;
+	res.tzo = 0;
+	res.tzn = NULL;
+
+	if (oid == DATEOID)
+		j2date(DatumGetDateADT(d->value) + POSTGRES_EPOCH_JDATE,
+			   &res.tm.tm_year, &res.tm.tm_mon, &res.tm.tm_mday);
+	else
+	{
+		PLLUA_TRY();
+		{
+			fsec_t		fsec = 0;
+
+			if (timestamp2tm(DatumGetTimestamp(d->value),
+							 tz ? &res.tzo : NULL,
+							 &res.tm,
+							 &fsec,
+							 tz ? &res.tzn : NULL,
+							 NULL) != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+						 errmsg("timestamp out of range")));
+			res.usec = FSEC_T_SCALE(fsec);
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+
+	if (!f)
+	{
+		f = lua_newuserdata(L, sizeof(struct pllua_time_fields));
+		pllua_set_user_field(L, nd, ".tmfields");
+	}
+	*f = res;
+	return f;
+}
+
+/*
+ * Push the value of a field from the broken-down value, with the same result
+ * as the SQL extract() would give. Returns false (having pushed nothing) if
+ * we can't handle it here.
+ */
+static bool
+pllua_time_fast_part(lua_State *L, int nd, pllua_datum *d, Oid oid,
+					 enum pllua_time_field_id id)
+{
+	struct pllua_time_fields *f;
+	struct pg_tm *tm;
+	int			dow;
+
+	if (id == PLLUA_TIME_TIMEZONE && oid != TIMESTAMPTZOID)
+		return false;
+
+	f = pllua_time_getfields(L, nd, d, oid);
+	if (!f)
+		return false;
+	tm = &f->tm;
+
+	switch (id)
+	{
+		case PLLUA_TIME_YEAR:
+			/* there is no year 0, 1 BC comes out as -1 */
+			lua_pushinteger(L, (tm->tm_year > 0) ? tm->tm_year : tm->tm_year - 1);
+			break;
+		case PLLUA_TIME_MONTH:
+			lua_pushinteger(L, tm->tm_mon);
+			break;
+		case PLLUA_TIME_DAY:
+			lua_pushinteger(L, tm->tm_mday);
+			break;
+		case PLLUA_TIME_HOUR:
+			lua_pushinteger(L, tm->tm_hour);
+			break;
+		case PLLUA_TIME_MINUTE:
+			lua_pushinteger(L, tm->tm_min);
+			break;
+		case PLLUA_TIME_SECOND:
+			lua_pushnumber(L, (tm->tm_sec * INT64CONST(1000000) + f->usec) / 1000000.0);
+			break;
+		case PLLUA_TIME_MICROSECONDS:
+			lua_pushinteger(L, tm->tm_sec * INT64CONST(1000000) + f->usec);
+			break;
+		case PLLUA_TIME_QUARTER:
+			lua_pushinteger(L, (tm->tm_mon - 1) / 3 + 1);
+			break;
+		case PLLUA_TIME_DOW:
+		case PLLUA_TIME_ISODOW:
+			dow = j2day(date2j(tm->tm_year, tm->tm_mon, tm->tm_mday));
+			if (id == PLLUA_TIME_ISODOW && dow == 0)
+				dow = 7;
+			lua_pushinteger(L, dow);
+			break;
+		case PLLUA_TIME_DOY:
+			lua_pushinteger(L, (date2j(tm->tm_year, tm->tm_mon, tm->tm_mday)
+								- date2j(tm->tm_year, 1, 1) + 1));
+			break;
+		case PLLUA_TIME_WEEK:
+			lua_pushinteger(L, date2isoweek(tm->tm_year, tm->tm_mon, tm->tm_mday));
+			break;
+		case PLLUA_TIME_TIMEZONE:
+			lua_pushinteger(L, -f->tzo);
+			break;
+	}
+
+	return true;
+}
+
+
 static float8
 pllua_time_raw_part(lua_State *L, const char *part, Datum val, Oid oid, PGFunction func, bool *isnull)
 {
@@ -871,6 +1097,16 @@ pllua_time_as_table(lua_State *L)
 						epoch_flt = get_float8_infinity();
 					break;
 				}
+				if (!found_tz && !found_gmtoff)
+				{
+					struct pllua_time_fields *f = pllua_time_getfields(L, 1, d, oid);
+
+					tm = f->tm;
+					tzn = f->tzn;
+					long_hour = tm.tm_hour;
+					microsecs = f->usec;
+					break;
+				}
 				PLLUA_TRY();
 				{
 					if (found_tz || found_gmtoff)
@@ -1075,10 +1311,353 @@ pllua_time_index(lua_State *L)
 	if (lua_getfield(L, lua_upvalueindex(3), part) != LUA_TNIL)
 		return 1;
 	lua_pop(L, 1);
+	if (lua_getfield(L, lua_upvalueindex(4), part) == LUA_TNUMBER
+		&& pllua_time_fast_part(L, 1, d, oid,
+								(enum pllua_time_field_id) lua_tointeger(L, -1)))
+		return 1;
+	lua_settop(L, 2);
 	return pllua_time_part(L, d, oid, part);
 }
 
 
+/*
+ * Direct conversions between Unix-epoch microseconds and timestamps.
+ *
+ * These are plain integer arithmetic, avoiding the general-purpose table
+ * constructor and the float arithmetic of the epoch fields, and they have
+ * array forms for bulk conversion.
+ */
+
+/*
+ * Convert the number at nd (which may be an infinity) to a Timestamp. Lua
+ * context.
+ */
+static Timestamp
+pllua_time_checkepoch(lua_State *L, int nd)
+{
+	int64		usec = 0;
+	int			inf_sign = 0;
+	Timestamp	result = 0;
+
+	getnumber(L, nd, &usec, NULL, &inf_sign, "epoch_usec");
+
+	if (inf_sign > 0)
+		TIMESTAMP_NOEND(result);
+	else if (inf_sign < 0)
+		TIMESTAMP_NOBEGIN(result);
+	else if (usec < PLLUA_MIN_EPOCH_USEC)
+		luaL_error(L, "timestamp out of range");
+	else
+	{
+#ifdef HAVE_INT64_TIMESTAMP
+		result = usec - PLLUA_EPOCH_DIFF_USEC;
+#else
+		result = (usec - PLLUA_EPOCH_DIFF_USEC) / 1000000.0;
+#endif
+	}
+
+	return result;
+}
+
+static void
+pllua_time_pushepoch(lua_State *L, Timestamp ts)
+{
+	int64		usec;
+
+	if (TIMESTAMP_IS_NOBEGIN(ts))
+	{
+		lua_pushnumber(L, -get_float8_infinity());
+		return;
+	}
+	else if (TIMESTAMP_IS_NOEND(ts))
+	{
+		lua_pushnumber(L, get_float8_infinity());
+		return;
+	}
+
+#ifdef HAVE_INT64_TIMESTAMP
+	if (ts > PG_INT64_MAX - PLLUA_EPOCH_DIFF_USEC)
+		luaL_error(L, "timestamp out of range");
+	usec = ts + PLLUA_EPOCH_DIFF_USEC;
+#else
+	usec = (int64) rint(ts * 1000000.0) + PLLUA_EPOCH_DIFF_USEC;
+#endif
+
+#ifdef PLLUA_INT8_OK
+	lua_pushinteger(L, usec);
+#else
+	lua_pushnumber(L, (lua_Number) usec);
+#endif
+}
+
+/*
+ * time.from_epoch_usec(n)		returns timestamptz
+ * time.from_epoch_usec(n, tz)	returns timestamp, as local time in tz
+ *
+ * tz is as for the "timezone" field of the table constructor.
+ *
+ * Upvalues: timestamptz typeinfo, timestamp typeinfo, timestamptz[] typeinfo
+ */
+static int
+pllua_time_from_epoch_usec(lua_State *L)
+{
+	int			nt = lua_upvalueindex(1);
+	pllua_typeinfo *t;
+	pllua_datum *d;
+	Timestamp	tsval;
+	const char *tzname = NULL;
+	int64		gmtoff = 0;
+	int			found_tz = 0;
+	int			found_gmtoff = 0;
+
+	lua_settop(L, 2);
+
+	tsval = pllua_time_checkepoch(L, 1);
+
+	switch (lua_type(L, 2))
+	{
+		case LUA_TNIL:
+			break;
+
+		case LUA_TBOOLEAN:
+			if (lua_toboolean(L, 2))
+				found_tz = 1;
+			break;
+
+		case LUA_TSTRING:
+			{
+				int tzoff = 0;
+				found_tz = 1;
+				tzname = lua_tostring(L, 2);
+				if (tzname && DecodeTimezone((char *) tzname, &tzoff) == 0)
+				{
+					gmtoff = -tzoff;
+					found_gmtoff = 1;
+				}
+			}
+			break;
+
+		default:
+			getnumber(L, 2, &gmtoff, NULL, NULL, "timezone");
+			found_gmtoff = 1;
+			break;
+	}
+
+	if (found_tz || found_gmtoff)
+		nt = lua_upvalueindex(2);
+
+	t = pllua_totypeinfo(L, nt);
+	d = pllua_newdatum(L, nt, (Datum) 0);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext;
+
+		if ((found_tz || found_gmtoff) && !TIMESTAMP_NOT_FINITE(tsval))
+		{
+			pg_tz	   *tz;
+			struct pg_tm tm;
+			fsec_t		fsec;
+			int			tzo;
+
+			tz = (found_gmtoff ? pg_tzset_offset(-gmtoff) :
+				  tzname ? pg_tzset(tzname) : session_timezone);
+			if (!tz)
+				ereport(ERROR,
+						(errmsg("invalid timezone specified")));
+			if (timestamp2tm(tsval, &tzo, &tm, &fsec, NULL, tz) != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+						 errmsg("timestamp out of range")));
+			if (tm2timestamp(&tm, fsec, NULL, &tsval) != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("could not convert to time zone")));
+		}
+
+		oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		d->value = TimestampGetDatum(tsval);
+		pllua_savedatum(L, d, t);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
+}
+
+/*
+ * time.to_epoch_usec(ts)
+ *
+ * ts is a timestamptz, or a timestamp which is taken as UTC (as for the epoch
+ * field).
+ */
+static int
+pllua_time_to_epoch_usec(lua_State *L)
+{
+	pllua_typeinfo *t;
+	pllua_datum *d = pllua_toanydatum(L, 1, &t);
+
+	if (!d || (t->typeoid != TIMESTAMPTZOID && t->typeoid != TIMESTAMPOID))
+		luaL_argerror(L, 1, "timestamp expected");
+	lua_pop(L, 1);
+
+	pllua_time_pushepoch(L, DatumGetTimestamp(d->value));
+	return 1;
+}
+
+/*
+ * time.from_epoch_usec_array(table [, n])
+ *
+ * Returns a timestamptz[] of n (default #table) elements, with nils becoming
+ * nulls.
+ */
+static int
+pllua_time_from_epoch_usec_array(lua_State *L)
+{
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(3));
+	pllua_datum *d;
+	lua_Integer n;
+	lua_Integer i;
+	Timestamp  *vals;
+	bool	   *nulls;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = lua_isnoneornil(L, 2) ? luaL_len(L, 1) : luaL_checkinteger(L, 2);
+	if (n < 0 || n > (lua_Integer) (MaxAllocSize / sizeof(Datum)))
+		luaL_error(L, "invalid array length");
+
+	/* collect the values first, so that any errors are raised in Lua */
+	vals = lua_newuserdata(L, n * (sizeof(Timestamp) + sizeof(bool)));
+	nulls = (bool *) (vals + n);
+	for (i = 0; i < n; ++i)
+	{
+		if (lua_geti(L, 1, i + 1) == LUA_TNIL)
+			nulls[i] = true;
+		else
+		{
+			vals[i] = pllua_time_checkepoch(L, -1);
+			nulls[i] = false;
+		}
+		lua_pop(L, 1);
+	}
+
+	d = pllua_newdatum(L, lua_upvalueindex(3), (Datum) 0);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext;
+
+		if (n == 0)
+			d->value = PointerGetDatum(construct_empty_array(TIMESTAMPTZOID));
+		else
+		{
+			Datum	   *elems = palloc(n * sizeof(Datum));
+			int			dims[1];
+			int			lbs[1];
+
+			for (i = 0; i < n; ++i)
+				elems[i] = nulls[i] ? (Datum) 0 : TimestampTzGetDatum(vals[i]);
+			dims[0] = n;
+			lbs[0] = 1;
+			d->value = PointerGetDatum(construct_md_array(elems, nulls,
+														  1, dims, lbs,
+														  TIMESTAMPTZOID,
+														  t->elemtyplen,
+														  t->elemtypbyval,
+														  t->elemtypalign));
+			pfree(elems);
+		}
+
+		oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		pllua_savedatum(L, d, t);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
+}
+
+/*
+ * time.to_epoch_usec_array(arr)
+ *
+ * arr is a timestamptz[] or timestamp[]; returns a table of the values (in
+ * storage order, with nils for nulls) and the number of elements.
+ *
+ * Array datums are normally held in expanded form, whose element arrays we
+ * can read in place once deconstructed; they belong to the datum, which stays
+ * on the stack. Only a flat value needs a deconstructed copy, freed at the end.
+ */
+static int
+pllua_time_to_epoch_usec_array(lua_State *L)
+{
+	pllua_typeinfo *t;
+	pllua_datum *d = pllua_toanydatum(L, 1, &t);
+	Datum	   *volatile elems = NULL;
+	bool	   *volatile elemnulls = NULL;
+	ArrayType  *volatile flatarr = NULL;
+	volatile int nelems = 0;
+	int			i;
+
+	if (!d || !t->is_array
+		|| (t->elemtype != TIMESTAMPTZOID && t->elemtype != TIMESTAMPOID))
+		luaL_argerror(L, 1, "timestamp array expected");
+	lua_pop(L, 1);
+
+	PLLUA_TRY();
+	{
+		if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(d->value)))
+		{
+			ExpandedArrayHeader *eah = (ExpandedArrayHeader *) DatumGetEOHP(d->value);
+
+			deconstruct_expanded_array(eah);
+			elems = eah->dvalues;
+			elemnulls = eah->dnulls;
+			nelems = eah->nelems;
+		}
+		else
+		{
+			ArrayType  *arr = DatumGetArrayTypeP(d->value);
+			Datum	   *e;
+			bool	   *n;
+			int			count;
+
+			deconstruct_array(arr, t->elemtype,
+							  t->elemtyplen, t->elemtypbyval, t->elemtypalign,
+							  &e, &n, &count);
+			elems = e;
+			elemnulls = n;
+			nelems = count;
+			flatarr = arr;
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_createtable(L, nelems, 0);
+	for (i = 0; i < nelems; ++i)
+	{
+		if (elemnulls && elemnulls[i])
+			continue;
+		pllua_time_pushepoch(L, DatumGetTimestamp(elems[i]));
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushinteger(L, nelems);
+
+	if (flatarr)
+	{
+		PLLUA_TRY();
+		{
+			pfree(elems);
+			pfree(elemnulls);
+			if ((Pointer) flatarr != DatumGetPointer(d->value))
+				pfree(flatarr);
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+
+	return 2;
+}
+
+
 static luaL_Reg time_methods[] = {
 	{ "as_table", pllua_time_as_table },
 	{ NULL, NULL }
@@ -1091,6 +1670,10 @@ static luaL_Reg time_meta[] = {
 };
 
 static luaL_Reg time_funcs[] = {
+	{ "from_epoch_usec", pllua_time_from_epoch_usec },
+	{ "to_epoch_usec", pllua_time_to_epoch_usec },
+	{ "from_epoch_usec_array", pllua_time_from_epoch_usec_array },
+	{ "to_epoch_usec_array", pllua_time_to_epoch_usec_array },
 	{ NULL, NULL }
 };
 
@@ -1105,7 +1688,25 @@ int pllua_open_time(lua_State *L)
 	lua_settop(L, 0);
 
 	lua_newtable(L);  /* module table at index 1 */
-	luaL_setfuncs(L, time_funcs, 0);
+
+	/* upvalues for module functions */
+	lua_pushcfunction(L, pllua_typeinfo_lookup);
+	lua_pushinteger(L, TIMESTAMPTZOID);
+	lua_call(L, 1, 1);
+	lua_pushcfunction(L, pllua_typeinfo_lookup);
+	lua_pushinteger(L, TIMESTAMPOID);
+	lua_call(L, 1, 1);
+	lua_pushcfunction(L, pllua_typeinfo_lookup);
+	lua_pushinteger(L, TIMESTAMPTZARRAYOID);
+	lua_call(L, 1, 1);
+	luaL_setfuncs(L, time_funcs, 3);
+
+	lua_newtable(L);  /* field ids at index 2 */
+	for (i = 0; time_fields[i].name; ++i)
+	{
+		lua_pushinteger(L, time_fields[i].id);
+		lua_setfield(L, -2, time_fields[i].name);
+	}
 
 	for (i = 0; OidIsValid(oidlist[i]); ++i)
 	{
@@ -1128,8 +1729,10 @@ int pllua_open_time(lua_State *L)
 		lua_pushinteger(L, oid);
 		/* methods table is third upvalue for metamethods */
 		luaL_setfuncs(L, time_methods, 2);
+		/* field ids are fourth upvalue for metamethods */
+		lua_pushvalue(L, 2);
 
-		luaL_setfuncs(L, time_meta, 3);
+		luaL_setfuncs(L, time_meta, 4);
 		lua_pop(L, 2);
 	}
 
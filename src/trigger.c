@@ -5,9 +5,11 @@
 #include "access/htup_details.h"
 #include "commands/event_trigger.h"
 #include "commands/trigger.h"
+#include "executor/executor.h"
 #include "utils/reltrigger.h"
 #include "utils/rel.h"
 #include "utils/lsyscache.h"
+#include "utils/tuplestore.h"
 
 typedef struct pllua_trigger
 {
@@ -83,6 +85,10 @@ pllua_checkevtrigger(lua_State *L, int nd)
  *  trigger.operation
  *  trigger.level
  *  trigger.relation
+ *  trigger:new_value(col)  - column of the new row, read in place
+ *  trigger:old_value(col)  - column of the old row, read in place
+ *  trigger.new_table  - iterator over the new transition table (pg10+)
+ *  trigger.old_table  - iterator over the old transition table (pg10+)
  *
  * Assigning nil or a new row to trigger.row modifies the result of the
  * trigger, though this is for compatibility and returning a new row or nil
@@ -160,6 +166,314 @@ pllua_trigger_get_old(lua_State *L)
 	return pllua_trigger_getrow(L, obj, obj->td->tg_trigtuple);
 }
 
+#if PG_VERSION_NUM >= 100000
+/*
+ * Transition tables.
+ *
+ * trigger.new_table and trigger.old_table (present only if the trigger has
+ * the corresponding REFERENCING clause) are functions:
+ *
+ *   for row in trigger.new_table() do ...
+ *   for rows in trigger.new_table(n) do ... -- sequences of up to n rows
+ *
+ * We read the tuplestore directly using our own read pointer, just as the
+ * executor does for a scan of the transition table, rather than going through
+ * SPI. The iterator is only valid for the duration of the trigger call.
+ */
+typedef struct pllua_trigger_table_state
+{
+	Tuplestorestate *ts;
+	TupleTableSlot *slot;
+	int			readptr;
+	int			batch;
+	pllua_datum **datums;
+} pllua_trigger_table_state;
+
+/*
+ * Upvalues: light[state], trigger, typeinfo, mcxt object
+ */
+static int
+pllua_trigger_table_next(lua_State *L)
+{
+	pllua_trigger_table_state *statep = lua_touserdata(L, lua_upvalueindex(1));
+	pllua_datum *single = NULL;
+	pllua_datum **datums = statep->batch ? statep->datums : &single;
+	int			nrows = statep->batch ? statep->batch : 1;
+	volatile int nfound = 0;
+	int			i;
+
+	pllua_checktrigger(L, lua_upvalueindex(2));
+
+	/*
+	 * Create all the result datums up front, so that we only need to enter pg
+	 * context once per batch.
+	 */
+	lua_settop(L, 0);
+	if (statep->batch)
+	{
+		lua_createtable(L, nrows, 0);
+		for (i = 0; i < nrows; ++i)
+		{
+			datums[i] = pllua_newdatum(L, lua_upvalueindex(3), (Datum)0);
+			lua_rawseti(L, 1, i+1);
+		}
+	}
+	else
+		datums[0] = pllua_newdatum(L, lua_upvalueindex(3), (Datum)0);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		int			n = 0;
+
+		tuplestore_select_read_pointer(statep->ts, statep->readptr);
+		while (n < nrows
+			   && tuplestore_gettupleslot(statep->ts, true, false, statep->slot))
+		{
+			pllua_datum *d = datums[n++];
+#if PG_VERSION_NUM >= 120000
+			d->value = ExecFetchSlotHeapTupleDatum(statep->slot);
+#else
+			d->value = ExecFetchSlotTupleDatum(statep->slot);
+#endif
+			d->need_gc = true;
+			pllua_record_gc_debt(L, VARSIZE(DatumGetPointer(d->value)));
+		}
+		ExecClearTuple(statep->slot);
+		nfound = n;
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (nfound == 0)
+		return 0;
+	for (i = nfound; i < nrows; ++i)
+	{
+		lua_pushnil(L);
+		lua_rawseti(L, 1, i+1);
+	}
+	return 1;
+}
+
+/*
+ * Upvalues: trigger, boolean (true for new_table)
+ */
+static int
+pllua_trigger_table_rows(lua_State *L)
+{
+	pllua_trigger *obj = pllua_checktrigger(L, lua_upvalueindex(1));
+	bool		is_new = lua_toboolean(L, lua_upvalueindex(2));
+	lua_Integer batch = luaL_optinteger(L, 1, 0);
+	Tuplestorestate *ts = is_new ? obj->td->tg_newtable : obj->td->tg_oldtable;
+	TupleDesc	tupdesc = obj->td->tg_relation->rd_att;
+	pllua_trigger_table_state *volatile statep = NULL;
+	MemoryContext mcxt;
+
+	if (batch < 0 || (Size) batch > MaxAllocSize / sizeof(pllua_datum *))
+		luaL_error(L, "batch size out of range");
+	if (!ts)
+		luaL_error(L, "transition table is not available");
+
+	lua_settop(L, 0);
+	lua_getuservalue(L, lua_upvalueindex(1));
+	pllua_trigger_get_typeinfo(L, obj, 1);
+	/* loop context object at index 3 */
+	mcxt = pllua_newmemcontext(L, "pllua transition table context",
+							   ALLOCSET_SMALL_SIZES);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(mcxt);
+		pllua_trigger_table_state *p = palloc(sizeof(pllua_trigger_table_state));
+
+		p->ts = ts;
+		/*
+		 * Use a private copy of the tupdesc, since the slot would otherwise
+		 * pin the relcache entry's one against the current resource owner.
+		 */
+#if PG_VERSION_NUM >= 120000
+		p->slot = MakeSingleTupleTableSlot(CreateTupleDescCopy(tupdesc),
+										   &TTSOpsMinimalTuple);
+#else
+		p->slot = MakeSingleTupleTableSlot(CreateTupleDescCopy(tupdesc));
+#endif
+		p->batch = (int) batch;
+		p->datums = batch ? palloc(batch * sizeof(pllua_datum *)) : NULL;
+		p->readptr = tuplestore_alloc_read_pointer(ts, EXEC_FLAG_REWIND);
+		tuplestore_select_read_pointer(ts, p->readptr);
+		tuplestore_rescan(ts);
+		statep = p;
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_pushlightuserdata(L, statep);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, pllua_trigger_table_next, 4);
+	lua_pushnil(L);
+	lua_pushnil(L);
+	lua_pushvalue(L, 3);  /* put the loop mcxt in the close slot */
+	return 4;
+}
+
+static int
+pllua_trigger_get_table(lua_State *L, bool is_new)
+{
+	pllua_trigger *obj = pllua_checktrigger(L, 1);
+	if (!(is_new ? obj->td->tg_newtable : obj->td->tg_oldtable))
+		return 0;
+	lua_settop(L, 1);
+	lua_pushboolean(L, is_new);
+	lua_pushcclosure(L, pllua_trigger_table_rows, 2);
+	return 1;
+}
+
+static int
+pllua_trigger_get_new_table(lua_State *L)
+{
+	return pllua_trigger_get_table(L, true);
+}
+
+static int
+pllua_trigger_get_old_table(lua_State *L)
+{
+	return pllua_trigger_get_table(L, false);
+}
+#endif
+
+/*
+ * trigger:new_value(col)
+ * trigger:old_value(col)
+ *
+ * Fetch one column of the new or old row. Getting trigger.new or trigger.old
+ * means copying (and detoasting) the whole tuple into a row datum, which is
+ * wasted effort if all the trigger does is look at one or two columns of a
+ * wide row. So if the row object hasn't been created yet, we read the column
+ * straight out of the trigger tuple, copying only that value. Once the row
+ * object exists, it might have been modified, so we read from it instead.
+ */
+static int
+pllua_trigger_value(lua_State *L, bool is_new)
+{
+	pllua_trigger *obj = pllua_checktrigger(L, 1);
+	TriggerEvent ev = obj->td->tg_event;
+	TupleDesc	tupdesc = obj->td->tg_relation->rd_att;
+	const char *which = is_new ? "new" : "old";
+	HeapTuple	tuple = NULL;
+	lua_Integer attno;
+	volatile Datum val = (Datum) 0;
+	volatile bool isnull = true;
+	pllua_typeinfo *et;
+	pllua_datum *d;
+
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1); /* index 3 */
+
+	switch (lua_getfield(L, 3, which))
+	{
+		case LUA_TNIL:
+			break;
+		case LUA_TBOOLEAN:
+			/* dummied-out "nil" from assigning to trigger.row */
+			luaL_error(L, "trigger %s row has been set to nil", which);
+			break;
+		default:
+			lua_pushvalue(L, 2);
+			lua_gettable(L, -2);
+			return 1;
+	}
+	lua_pop(L, 1);
+
+	if (TRIGGER_FIRED_FOR_ROW(ev))
+	{
+		if (!is_new)
+			tuple = TRIGGER_FIRED_BY_INSERT(ev) ? NULL : obj->td->tg_trigtuple;
+		else if (TRIGGER_FIRED_BY_INSERT(ev))
+			tuple = obj->td->tg_trigtuple;
+		else if (TRIGGER_FIRED_BY_UPDATE(ev))
+			tuple = obj->td->tg_newtuple;
+	}
+	if (!tuple)
+		luaL_error(L, "trigger has no %s row", which);
+
+	pllua_trigger_get_typeinfo(L, obj, 3);  /* index 4 */
+
+	if (lua_type(L, 2) == LUA_TSTRING)
+	{
+		pllua_get_user_field(L, 4, "attrs");
+		lua_pushvalue(L, 2);
+		if (lua_gettable(L, -2) != LUA_TNUMBER)
+			luaL_error(L, "datum has no column \"%s\"", lua_tostring(L, 2));
+		attno = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+	}
+	else
+		attno = luaL_checkinteger(L, 2);
+
+	if (IsObjectIdAttributeNumber(attno) && TupleDescHasOids(tupdesc))
+	{
+		lua_pushinteger(L, (lua_Integer) HeapTupleHeaderGetOid(tuple->t_data));
+		return 1;
+	}
+	if (attno < 1 || attno > tupdesc->natts
+		|| TupleDescAttr(tupdesc, attno - 1)->attisdropped)
+		luaL_error(L, "datum has no column number %d", (int) attno);
+
+	pllua_get_user_field(L, 4, "attrtypes");
+	lua_rawgeti(L, -1, (lua_Integer) attno);  /* index 6 */
+	et = pllua_checktypeinfo(L, 6, false);
+
+	PLLUA_TRY();
+	{
+		bool		isnull_tmp;
+
+		val = heap_getattr(tuple, (int) attno, tupdesc, &isnull_tmp);
+		isnull = isnull_tmp;
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (isnull)
+		lua_pushnil(L);
+	else if (pllua_value_from_datum(L, val, et->basetype) == LUA_TNONE &&
+			 pllua_datum_transform_fromsql(L, val, 6, et) == LUA_TNONE)
+	{
+		d = pllua_newdatum(L, 6, val);
+		if (et->typeoid != RECORDOID)
+			d->typmod = TupleDescAttr(tupdesc, attno - 1)->atttypmod;
+		pllua_save_one_datum(L, d, et);
+	}
+	return 1;
+}
+
+static int
+pllua_trigger_new_value(lua_State *L)
+{
+	return pllua_trigger_value(L, true);
+}
+
+static int
+pllua_trigger_old_value(lua_State *L)
+{
+	return pllua_trigger_value(L, false);
+}
+
+static int
+pllua_trigger_get_new_value(lua_State *L)
+{
+	lua_pushcfunction(L, pllua_trigger_new_value);
+	return 1;
+}
+
+static int
+pllua_trigger_get_old_value(lua_State *L)
+{
+	lua_pushcfunction(L, pllua_trigger_old_value);
+	return 1;
+}
+
 static int
 pllua_trigger_get_name(lua_State *L)
 {
@@ -472,6 +786,16 @@ pllua_return_trigger_result(lua_State *L, int nret, int nd)
 			}
 			return pllua_trigger_copytuple(L, d->value, obj->td->tg_relation->rd_id);
 		}
+		else if (!obj->modified)
+		{
+			/*
+			 * The original row was modified by assigning to its columns; if
+			 * we know which ones, just replace those in the original tuple.
+			 */
+			HeapTuple	newtup = pllua_datum_modify_tuple(L, -1, (HeapTuple) DatumGetPointer(retval));
+			if (newtup)
+				return PointerGetDatum(newtup);
+		}
 
 		retindex = lua_gettop(L);
 		nret = 1;
@@ -492,6 +816,13 @@ pllua_return_trigger_result(lua_State *L, int nret, int nd)
 				luaL_error(L, "incorrect type in trigger.row on return from trigger");
 			if (!d->modified)
 				return retval;   /* user returned the row unchanged */
+			else
+			{
+				/* user returned the row after assigning to its columns */
+				HeapTuple	newtup = pllua_datum_modify_tuple(L, -1, (HeapTuple) DatumGetPointer(retval));
+				if (newtup)
+					return PointerGetDatum(newtup);
+			}
 		}
 		lua_pop(L, 3);
 	}
@@ -526,6 +857,12 @@ pllua_push_trigger_args(lua_State *L, TriggerData *td)
 static struct luaL_Reg triggerobj_keys[] = {
 	{ "new", pllua_trigger_get_new },
 	{ "old", pllua_trigger_get_old },
+	{ "new_value", pllua_trigger_get_new_value },
+	{ "old_value", pllua_trigger_get_old_value },
+#if PG_VERSION_NUM >= 100000
+	{ "new_table", pllua_trigger_get_new_table },
+	{ "old_table", pllua_trigger_get_old_table },
+#endif
 	{ "name", pllua_trigger_get_name },
 	{ "when", pllua_trigger_get_when },
 	{ "operation", pllua_trigger_get_operation },
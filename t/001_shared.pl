@@ -0,0 +1,122 @@
+# Tests for pllua.shared, which needs pllua preloaded and so can't be
+# tested by the regression suite.
+
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'pllua'
+pllua.shared_memory_size = 4096
+});
+$node->start;
+
+# sh(code) runs code with the module as its argument, and returns the
+# result as a string
+$node->safe_psql('postgres', q{
+create extension plluau;
+create function sh(code text) returns text language plluau as $$
+  return tostring(assert(load(code))(require 'pllua.shared'))
+$$;
+});
+
+sub sh
+{
+	my ($code) = @_;
+	$code =~ s/'/''/g;
+	return $node->safe_psql('postgres',
+		"select sh('local shared = ... ' || '$code')");
+}
+
+# basic operations, and the versions they report
+is(sh(q{
+  local v1 = shared.set("a", 1)
+  local v2 = shared.set("b", { 1, 2.5, "x", true, n = 3 })
+  return table.concat({ tostring(v2 > v1), tostring(shared.version("b") == v2),
+                        tostring(shared.version() >= v2),
+                        tostring(shared.version("nosuch")) }, ",")
+}), 'true,true,true,nil', 'versions');
+
+is(sh(q{
+  local t = shared.get("b")
+  return table.concat({ math.type(shared.get("a")), t[1], t[2], t[3],
+                        tostring(t[4]), t.n }, ",")
+}), 'integer,1,2.5,x,true,3', 'values survive across backends');
+
+# a returned table is a copy, whether fetched from the store or the cache
+is(sh(q{
+  local t = shared.get("b")
+  t.n = 99
+  local t2 = shared.get("b")
+  t2.n = 100
+  return shared.get("b").n
+}), '3', 'returned tables are copies');
+
+# a write to another key bumps the global version, so the next get must
+# check the entry's version and keep its cached value; a write to the key
+# itself must be seen
+is(sh(q{
+  local r = {}
+  r[1] = shared.get("a")
+  shared.set("c", "other")
+  r[2] = shared.get("a")
+  shared.set("a", 2)
+  r[3] = shared.get("a")
+  shared.set("a", nil)
+  r[4] = tostring(shared.get("a"))
+  return table.concat(r, ",")
+}), '1,1,2,nil', 'cache follows writes in the same backend');
+
+# a write from another backend must be seen by one that has the old value
+# cached. (BackgroundPsql only exists in pg 16+.)
+SKIP:
+{
+	skip 'no BackgroundPsql', 1
+	  unless eval { require PostgreSQL::Test::BackgroundPsql; 1 };
+
+	my $session = $node->background_psql('postgres');
+	$session->query_safe(
+		q{select sh('local shared = ... shared.set("d", "old") return shared.get("d")')});
+	sh(q{ shared.set("d", "new") });
+	is($session->query_safe(
+			q{select sh('local shared = ... return shared.get("d")')}),
+		'new', 'cache sees writes from other backends');
+	$session->quit;
+}
+
+# more keys than the cache holds, read twice so that the second pass
+# comes partly from the cache and partly from the store again
+is(sh(q{
+  for i = 1,1500 do shared.set("k" .. i, i) end
+  local bad = 0
+  for pass = 1,2 do
+    for i = 1,1500 do
+      if shared.get("k" .. i) ~= i then bad = bad + 1 end
+    end
+  end
+  return bad
+}), '0', 'cache bound');
+
+is(sh(q{
+  local n = 0
+  for _,k in ipairs(shared.keys()) do
+    if k:match("^k%d+$") then n = n + 1 end
+  end
+  return table.concat({ n, tostring(shared.delete("k1")),
+                        tostring(shared.delete("k1")) }, ",")
+}), '1500,true,false', 'keys and delete');
+
+# running out of space must not lose the old value
+my ($ret, $stdout, $stderr) = $node->psql('postgres',
+	q{select sh('local shared = ... return shared.set("k2", string.rep("x", 8000000))')});
+like($stderr, qr/out of pllua shared memory/, 'store full');
+is(sh(q{ return shared.get("k2") }), '2', 'old value kept when store full');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,64 @@
+#!/bin/sh
+
+# bench.sh: run the pgbench scripts in bench/scripts and write the
+# results as JSON lines.
+#
+# usage: bench.sh bindir benchdir duration outfile [script ...]
+#
+# Connection parameters are taken from the usual PG* environment
+# variables. With no scripts named, all of them are run. Each result
+# line is also echoed to stdout.
+
+bindir="$1"
+benchdir="$2"
+duration="$3"
+outfile="$4"
+shift 4
+
+psql="$bindir/psql"
+pgbench="$bindir/pgbench"
+
+"$psql" -X -q -f "$benchdir/setup.sql" || exit 1
+
+scalar() {
+	"$psql" -X -q -A -t -c "$1"
+}
+
+lua_version=$(scalar "select pllua_bench.lua_version()") || exit 1
+server_version=$(scalar "show server_version_num") || exit 1
+commit=$(git -C "$benchdir" rev-parse --short HEAD 2>/dev/null || echo unknown)
+stamp=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+
+if [ $# -eq 0 ]; then
+	set -- "$benchdir"/scripts/*.sql
+fi
+
+for script; do
+	name=${script##*/}
+	name=${name%.sql}
+
+	# one untimed pass so that compilation and cache loading is not
+	# counted
+	"$psql" -X -q -f "$script" >/dev/null || exit 1
+
+	out=$("$pgbench" -n -c 1 -T "$duration" -f "$script" 2>&1) || {
+		printf '%s\n' "$out" >&2
+		exit 1
+	}
+
+	# older pgbench reports tps both including and excluding connection
+	# time; we want the latter
+	tps=$(printf '%s\n' "$out" | awk '
+		/^tps = / { v = $3; if (/excluding|without/) x = $3 }
+		END { print (x != "" ? x : v) }')
+	latency=$(printf '%s\n' "$out" | awk '/^latency average/ { print $4 }')
+
+	line=$(printf '{"benchmark": "%s", "tps": %s, "latency_ms": %s, "duration_s": %s, "lua": "%s", "server_version": %s, "commit": "%s", "time": "%s"}' \
+		"$name" "${tps:-null}" "${latency:-null}" "$duration" \
+		"$lua_version" "$server_version" "$commit" "$stamp")
+
+	printf '%s\n' "$line"
+	printf '%s\n' "$line" >>"$outfile"
+done
+
+exit 0